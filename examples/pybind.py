@@ -1,8 +1,25 @@
 import gathering
 import numpy as np
 
-gathering.load("cut1_2.obj", 1000, 1200, 1600)
-gathering.setSubstepSize(0.03)
-gathering.applyForce(10, False, 0.2, 0.2, 0.2)
-images = gathering.takeImages(4)
-gathering.close()
+with gathering.Simulation("cut1_2.obj", 1000, 1200, 1600) as sim:
+    sim.setSubstepSize(0.03)
+    sim.applyForce(10, False, 0.2, 0.2, 0.2, render_interval_steps=10)
+    images = sim.takeImages(4)  # (3 + 4, height, width), valid until the next call
+    out = np.empty_like(images)
+    sim.takeImages(4, out=out)  # renders into an array of the caller
+    positions = sim.positions()  # no copy; rows are particles
+    profile = sim.profile()  # time per phase in microseconds and event counts
+    print(max((k for k in profile if k.endswith("_us") and k != "step_us"), key=profile.get))
+
+# depth and density from the same render pass
+with gathering.Simulation("cut1_2.obj", 1000, 120, 160, headless=True,
+                          channels=["occupancy", "depth", "density"]) as sim:
+    sim.applyForce(10, True, 0.2, 0.2, 0.2)
+    channels = sim.takeImages(4)  # dict: name -> (3 + 4, height, width)
+    depth, density = channels["depth"], channels["density"]
+
+# several headless instances, stepped in parallel with one call
+with gathering.BatchSimulation(["cut1_2.obj"] * 8, 1000, 120, 160) as batch:
+    forces = np.tile([0.2, 0.2, 0.2], (len(batch), 1)).astype(np.float32)
+    batch.step(10, forces)
+    images = batch.takeImages(4)  # (instances, 3 + 4, height, width)
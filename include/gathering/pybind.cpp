@@ -4,6 +4,7 @@
 #ifdef GATHERING_PYBIND
 
 #include <pybind11/eigen.h>
+#include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
@@ -11,6 +12,7 @@
 #include <memory>
 #include <string>
 
+#include "meta.hpp"
 #include "simulation.hpp"
 
 using namespace pybind11::literals;
@@ -18,57 +20,527 @@ namespace py = pybind11;
 
 namespace gathering {
 
-typedef Eigen::Matrix<unsigned char, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> MatrixXb;
-std::unique_ptr<Simulation> simulation_instance(nullptr);
-std::vector<Eigen::Map<const MatrixXb>> maps;
-
-void load(const std::string& file,
-          const int cnt_particles,
-          const int image_width,
-          const int image_height) {
-    SimulationSettings settings;
-    settings.resolution = {image_width, image_height};
-    simulation_instance = std::make_unique<Simulation>(file.c_str(), 0.03f, settings);
-    simulation_instance->addParticles(cnt_particles, 1.0f, 0.01f);
-}
+typedef py::array_t<unsigned char, py::array::c_style> ImageArray;
 
-void applyForce(
-    const int duration, const bool headless, const float x, const float y, const float z) {
-    glm::vec3 force = glm::vec3(x, y, z);
-    ForceSchedule schedule = {{duration, force}};
-    simulation_instance->runTime(duration, schedule, headless);
+/**
+ * @brief Python object that keeps the given object alive as long as it exists; the base of
+ * arrays over memory of that object.
+ */
+template <typename T>
+py::capsule keepAlive(std::shared_ptr<T> owner) {
+    return py::capsule(new std::shared_ptr<T>(std::move(owner)), [](void* p) {
+        delete static_cast<std::shared_ptr<T>*>(p);
+    });
 }
 
-void setSubstepSize(const float substep) { simulation_instance->dt = substep; }
+/**
+ * @brief NumPy array over the particle memory of a simulation (no copy): shape (n, columns),
+ * rows are particles. The array keeps the simulation alive, also after the python object was
+ * closed.
+ */
+py::array_t<float> particleArray(const ParticleArrays& arrays,
+                                 float* data,
+                                 const size_t columns,
+                                 const bool writable,
+                                 std::shared_ptr<Simulation> simulation) {
+    py::capsule owner = keepAlive(std::move(simulation));
+    std::vector<size_t> shape = {arrays.count, columns};
+    std::vector<size_t> strides = {arrays.stride, sizeof(float)};
+    py::array_t<float> array(shape, strides, data, owner);
+    if (!writable) array.attr("flags").attr("writeable") = false;
+    return array;
+}
 
-const std::vector<Eigen::Map<const MatrixXb>>& takeImages(const int slice_count) {
-    ImageContainer& image_container = simulation_instance->take_images(slice_count);
-    Resolution resolution = simulation_instance->getSettings().resolution;
+/**
+ * @brief Memory of an array provided by the caller for the images (no copy). It must be a
+ * writable, c-contiguous uint8 array with as many elements as the given shape.
+ */
+unsigned char* imageOutput(py::handle out, const std::vector<size_t>& shape) {
+    size_t size = 1;
+    for (size_t extent : shape) size *= extent;
+    if (!py::isinstance<ImageArray>(out)) {
+        throw py::type_error("out must be a c-contiguous numpy array of type uint8.");
+    }
+    ImageArray array = py::reinterpret_borrow<ImageArray>(out);
+    if (static_cast<size_t>(array.size()) != size || !array.writeable()) {
+        throw py::value_error("out must be writable and hold all images.");
+    }
+    return array.mutable_data();
+}
 
-    // assumption: image container stays valid; resolution does not change
-    if (image_container.images.size() != maps.size()) {
-        maps.clear();
-        for (const auto& img : image_container.images) {
-            maps.emplace_back(img.data(), resolution.height, resolution.width);
+/**
+ * @brief ImageChannel mask from the python names of the channels.
+ */
+unsigned int channelMask(const std::vector<std::string>& names) {
+    unsigned int mask = ImageChannel::OCCUPANCY;
+    for (const std::string& name : names) {
+        if (name == "occupancy") {
+            mask |= ImageChannel::OCCUPANCY;
+        } else if (name == "depth") {
+            mask |= ImageChannel::DEPTH;
+        } else if (name == "density") {
+            mask |= ImageChannel::DENSITY;
+        } else if (name == "ids") {
+            mask |= ImageChannel::PARTICLE_ID;
+        } else {
+            throw py::value_error("Unknown image channel '" + name + "'.");
         }
     }
-    return maps;
+    return mask;
 }
 
-void close() { simulation_instance.release(); }
+/**
+ * @brief StepProfile as python dict; times in microseconds.
+ */
+py::dict profileDict(const StepProfile& profile) {
+    py::dict result;
+    result["steps"] = profile.steps;
+    result["step_us"] = profile.stepUs();
+    result["integrate_us"] = profile.integrate_us;
+    result["grid_us"] = profile.grid_us;
+    result["particle_collisions_us"] = profile.particle_collisions_us;
+    result["particle_response_us"] = profile.particle_response_us;
+    result["vessel_broad_phase_us"] = profile.vessel_broad_phase_us;
+    result["vessel_narrow_phase_us"] = profile.vessel_narrow_phase_us;
+    result["apply_us"] = profile.apply_us;
+    result["render_us"] = profile.render_us;
+    result["images_us"] = profile.images_us;
+    result["readback_us"] = profile.readback_us;
+    result["particle_candidates"] = profile.particle_candidates;
+    result["particle_contacts"] = profile.particle_contacts;
+    result["particle_responses"] = profile.particle_responses;
+    result["vessel_candidates"] = profile.vessel_candidates;
+    result["vessel_contacts"] = profile.vessel_contacts;
+    result["speed_clamps"] = profile.speed_clamps;
+    return result;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Python class "Simulation": one simulation with its own window (if not headless).
+ */
+class PySimulation {
+   public:
+    PySimulation(const std::string& file,
+                 const int cnt_particles,
+                 const int image_width,
+                 const int image_height,
+                 const float dt,
+                 const bool headless,
+                 const std::vector<std::string>& channels,
+                 const std::string& trace_file,
+                 const float particle_radius,
+                 const float particle_radius_stddev) {
+        SimulationSettings settings;
+        settings.resolution = {image_width, image_height};
+        settings.headless = headless;
+        settings.channels = channelMask(channels);
+        settings.trace_file = trace_file;
+        settings.particle_radius = particle_radius;
+        settings.particle_radius_stddev = particle_radius_stddev;
+        simulation = std::make_shared<Simulation>(file.c_str(), dt, settings);
+        simulation->addParticles(cnt_particles, 1.0f, 0.01f);
+    }
+
+    void applyForce(const int duration,
+                    const bool headless,
+                    const float x,
+                    const float y,
+                    const float z,
+                    const unsigned int render_interval_steps,
+                    const float render_budget_ms,
+                    const bool render_interpolation) {
+        sim().setRenderPacing(render_interval_steps, render_budget_ms, render_interpolation);
+        ForceSchedule schedule = {{duration, glm::vec3(x, y, z)}};
+        sim().runTime(duration, schedule, headless);
+    }
+
+    /**
+     * @brief Like applyForce (headless), but returns immediately; the steps run on a worker
+     * thread. All other methods wait for them to finish. Refused while particle arrays
+     * (positions() etc.) exist, as they would be read or written during the steps.
+     */
+    void stepAsync(const int duration, const float x, const float y, const float z) {
+        if (particleViews() > 0) {
+            throw std::runtime_error(
+                "step_async needs the particle arrays (positions() etc.) to be deleted.");
+        }
+        ForceSchedule schedule = {{duration, glm::vec3(x, y, z)}};
+        sim().runStepsAsync(static_cast<int>(duration / sim().dt), schedule);
+    }
+
+    void wait() { sim().waitSteps(); }
+    void setSubstepSize(const float substep) { sim().setTimeStep(substep); }
+
+    /**
+     * @brief All images in one array [3 + slice_count, height, width]. Without 'out' the array
+     * shares the memory of the simulation and is overwritten by the next call; the memory is
+     * kept alive by the array. If further channels were requested, a dict with one such array
+     * per channel is returned instead.
+     */
+    py::object takeImages(const int slice_count, py::object out) {
+        const Resolution resolution = sim().getSettings().resolution;
+        std::vector<size_t> shape = {Simulation::imageCount(slice_count),
+                                     static_cast<size_t>(resolution.height),
+                                     static_cast<size_t>(resolution.width)};
+        const bool channels = sim().getSettings().channels != ImageChannel::OCCUPANCY;
+        if (!out.is_none()) {
+            if (channels) throw py::value_error("out is only supported for occupancy images.");
+            unsigned char* output = imageOutput(out, shape);
+            py::gil_scoped_release release;
+            sim().take_images(slice_count, output);
+            return out;
+        }
+
+        ImageContainer* images = nullptr;
+        {
+            py::gil_scoped_release release;
+            images = &sim().take_images(slice_count);
+        }
+        py::capsule owner = keepAlive(images->shareBlock());
+        py::array_t<unsigned char> occupancy(shape, images->data(), owner);
+        if (!channels) return std::move(occupancy);
+
+        py::dict result;
+        result["occupancy"] = occupancy;
+        if (images->depth() != nullptr) {
+            result["depth"] = py::array_t<float>(shape, images->depth(), owner);
+        }
+        if (images->density() != nullptr) {
+            result["density"] = py::array_t<float>(shape, images->density(), owner);
+        }
+        if (images->ids() != nullptr) {
+            result["ids"] = py::array_t<uint32_t>(shape, images->ids(), owner);
+        }
+        return std::move(result);
+    }
+
+    py::array_t<float> positions(const bool writable) {
+        ParticleArrays arrays = sim().particleArrays();
+        return particleArray(arrays, arrays.position, 3, writable, simulation);
+    }
+
+    py::array_t<float> velocities(const bool writable) {
+        ParticleArrays arrays = sim().particleArrays();
+        return particleArray(arrays, arrays.velocity, 3, writable, simulation);
+    }
+
+    py::array_t<float> masses(const bool writable) {
+        ParticleArrays arrays = sim().particleArrays();
+        return particleArray(arrays, arrays.mass, 1, writable, simulation);
+    }
+
+    py::array_t<float> radii() {
+        ParticleArrays arrays = sim().particleArrays();
+        return particleArray(arrays, arrays.radius, 1, false, simulation);
+    }
+
+    py::dict profile() {
+        StepProfile profile;
+        {
+            py::gil_scoped_release release;
+            profile = sim().profile();
+        }
+        return profileDict(profile);
+    }
+
+    void resetProfile() { sim().resetProfile(); }
+
+    /**
+     * @brief Waits for running steps and releases the window and the gl context here. The
+     * simulation is destroyed as soon as no particle array refers to it anymore, on whatever
+     * thread drops the last one, which then only frees CPU memory. Stays open if releasing
+     * throws.
+     */
+    void close() {
+        if (simulation) simulation->releaseGL();
+        simulation.reset();
+    }
+
+   private:
+    Simulation& sim() {
+        if (!simulation) throw std::runtime_error("The simulation is closed.");
+        return *simulation;
+    }
+
+    // particle arrays that keep the simulation alive; they are created and destroyed with
+    // the gil held only
+    long particleViews() const { return simulation ? simulation.use_count() - 1 : 0; }
+
+    std::shared_ptr<Simulation> simulation;
+};
+
+// ------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Python class "BatchSimulation": several headless simulations that are stepped (and
+ * imaged) in parallel with a single call.
+ */
+class PyBatchSimulation {
+   public:
+    PyBatchSimulation(const std::vector<std::string>& files,
+                      const int cnt_particles,
+                      const int image_width,
+                      const int image_height,
+                      const float dt,
+                      const unsigned int threads,
+                      const float particle_radius,
+                      const float particle_radius_stddev)
+        : threads(threadCount(threads)), resolution({image_width, image_height}) {
+        SimulationSettings settings;
+        settings.particle_radius = particle_radius;
+        settings.particle_radius_stddev = particle_radius_stddev;
+        settings.resolution = resolution;
+        settings.headless = true;
+        settings.imaging_threads = 1;  // parallel over the simulations instead
+        simulations.resize(files.size());
+        parallelFor(files.size(), this->threads, [&](size_t begin, size_t end, unsigned int) {
+            for (size_t i = begin; i < end; ++i) {
+                simulations[i] = std::make_shared<Simulation>(files[i].c_str(), dt, settings);
+                simulations[i]->addParticles(cnt_particles, 1.0f, 0.01f);
+            }
+        });
+    }
+
+    size_t size() const { return simulations.size(); }
+
+    /**
+     * @brief Simulates all instances for the given time; instance i with the force in row i.
+     */
+    void step(const int duration, const Eigen::MatrixX3f& forces) {
+        if (static_cast<size_t>(forces.rows()) != simulations.size()) {
+            throw py::value_error("One force (row) per simulation is needed.");
+        }
+        parallelFor(simulations.size(), threads, [&](size_t begin, size_t end, unsigned int) {
+            for (size_t i = begin; i < end; ++i) {
+                glm::vec3 force = glm::vec3(forces(i, 0), forces(i, 1), forces(i, 2));
+                ForceSchedule schedule = {{duration, force}};
+                simulations[i]->runTime(duration, schedule, true);
+            }
+        });
+    }
+
+    /**
+     * @brief The images of all instances in one array [instances, 3 + slice_count, height,
+     * width]. Without 'out' the array is overwritten by the next call (see
+     * PySimulation::takeImages).
+     */
+    py::object takeImages(const int slice_count, py::object out) {
+        const size_t count = Simulation::imageCount(slice_count);
+        std::vector<size_t> shape = {simulations.size(),
+                                     count,
+                                     static_cast<size_t>(resolution.height),
+                                     static_cast<size_t>(resolution.width)};
+        unsigned char* output = nullptr;
+        if (out.is_none()) {
+            images.reset(resolution.width, resolution.height, simulations.size() * count);
+            output = images.data();
+        } else {
+            output = imageOutput(out, shape);
+        }
+
+        {
+            py::gil_scoped_release release;
+            const size_t stride = count * shape[2] * shape[3];
+            parallelFor(simulations.size(), threads, [&](size_t begin, size_t end, unsigned) {
+                for (size_t i = begin; i < end; ++i) {
+                    simulations[i]->take_images(slice_count, output + i * stride);
+                }
+            });
+        }
+
+        if (!out.is_none()) return out;
+        return py::array_t<unsigned char>(shape, output, keepAlive(images.shareBlock()));
+    }
+
+    std::vector<py::array_t<float>> positions(const bool writable) {
+        std::vector<py::array_t<float>> arrays;
+        for (auto& simulation : simulations) {
+            ParticleArrays particles = simulation->particleArrays();
+            arrays.push_back(
+                particleArray(particles, particles.position, 3, writable, simulation));
+        }
+        return arrays;
+    }
+
+    std::vector<py::array_t<float>> velocities(const bool writable) {
+        std::vector<py::array_t<float>> arrays;
+        for (auto& simulation : simulations) {
+            ParticleArrays particles = simulation->particleArrays();
+            arrays.push_back(
+                particleArray(particles, particles.velocity, 3, writable, simulation));
+        }
+        return arrays;
+    }
+
+    py::list profile() {
+        py::list result;
+        for (auto& simulation : simulations) result.append(profileDict(simulation->profile()));
+        return result;
+    }
+
+    void resetProfile() {
+        for (auto& simulation : simulations) simulation->resetProfile();
+    }
+
+    void close() { simulations.clear(); }
+
+   private:
+    unsigned int threads;
+    Resolution resolution;
+    std::vector<std::shared_ptr<Simulation>> simulations;
+    ImageContainer images;  // of all instances
+};
+
+// ------------------------------------------------------------------------------------------------
 
 PYBIND11_MODULE(gathering, m) {
-    m.def("load",
-          &load,
-          "Load an instance and insert k particles.",
-          "file"_a,
-          "cnt_particle"_a,
-          "image_width"_a,
-          "image_height"_a);
-    m.def("applyForce", &applyForce, "duration"_a, "headless"_a, "x"_a, "y"_a, "z"_a);
-    m.def("setSubstepSize", &setSubstepSize);
-    m.def("takeImages", &takeImages, py::return_value_policy::reference_internal);
-    m.def("close", &close);
+    py::class_<PySimulation>(m, "Simulation")
+        .def(py::init<const std::string&,
+                      const int,
+                      const int,
+                      const int,
+                      const float,
+                      const bool,
+                      const std::vector<std::string>&,
+                      const std::string&,
+                      const float,
+                      const float>(),
+             "Load an instance and insert k particles. channels: images taken per view; any "
+             "of 'occupancy', 'depth', 'density' and 'ids'. 'ids' are only rendered on the "
+             "CPU: requesting them renders all channels with the software renderer, even if "
+             "a window is shown. trace_file: if given, a timeline (Chrome trace json) of "
+             "each run is written to this file after the run. "
+             "particle_radius_stddev: if > 0, the radii are drawn from a normal distribution "
+             "around particle_radius.",
+             "file"_a,
+             "cnt_particle"_a,
+             "image_width"_a,
+             "image_height"_a,
+             "dt"_a = 0.03f,
+             "headless"_a = false,
+             "channels"_a = std::vector<std::string>{"occupancy"},
+             "trace_file"_a = "",
+             "particle_radius"_a = SimulationSettings().particle_radius,
+             "particle_radius_stddev"_a = SimulationSettings().particle_radius_stddev)
+        .def("applyForce",
+             &PySimulation::applyForce,
+             "Simulate for the given time. If not headless, every render_interval_steps-th "
+             "step is rendered; render_budget_ms limits the rendering time per second (0 = no "
+             "limit).",
+             "duration"_a,
+             "headless"_a,
+             "x"_a,
+             "y"_a,
+             "z"_a,
+             "render_interval_steps"_a = 1,
+             "render_budget_ms"_a = 0.f,
+             "render_interpolation"_a = false,
+             py::call_guard<py::gil_scoped_release>())
+        .def("step_async",
+             &PySimulation::stepAsync,
+             "Simulate headless for the given time on a worker thread; returns immediately. "
+             "Raises while particle arrays (positions() etc.) exist.",
+             "duration"_a,
+             "x"_a,
+             "y"_a,
+             "z"_a,
+             py::call_guard<py::gil_scoped_release>())
+        .def("wait",
+             &PySimulation::wait,
+             "Wait for step_async to finish.",
+             py::call_guard<py::gil_scoped_release>())
+        .def("setSubstepSize",
+             &PySimulation::setSubstepSize,
+             "Change dt; waits for step_async to finish first.",
+             "substep"_a,
+             py::call_guard<py::gil_scoped_release>())
+        .def("takeImages",
+             &PySimulation::takeImages,
+             "All images as one uint8 array (3 + slice_count, height, width); a dict of such "
+             "arrays if further channels were requested. Renders into 'out' if given; "
+             "otherwise the arrays are overwritten by the next call.",
+             "slice_count"_a,
+             "out"_a = py::none())
+        .def("positions",
+             &PySimulation::positions,
+             "Particle positions (n x 3) without a copy. The array keeps the simulation alive "
+             "(also after close()); step_async is refused while it exists.",
+             "writable"_a = false)
+        .def("velocities",
+             &PySimulation::velocities,
+             "Particle velocities (n x 3) without a copy; see positions.",
+             "writable"_a = false)
+        .def("masses",
+             &PySimulation::masses,
+             "Particle masses (n x 1) without a copy; see positions.",
+             "writable"_a = false)
+        .def("radii",
+             &PySimulation::radii,
+             "Particle radii (n x 1) without a copy, read only; see positions.")
+        .def("profile",
+             &PySimulation::profile,
+             "Time per phase (microseconds) and event counts of all steps since the last "
+             "resetProfile, as dict.")
+        .def("resetProfile",
+             &PySimulation::resetProfile,
+             py::call_guard<py::gil_scoped_release>())
+        .def("close", &PySimulation::close, py::call_guard<py::gil_scoped_release>())
+        .def("__enter__", [](py::object self) { return self; })
+        .def("__exit__", [](PySimulation& self, py::args) { self.close(); });
+
+    py::class_<PyBatchSimulation>(m, "BatchSimulation")
+        .def(py::init<const std::vector<std::string>&,
+                      const int,
+                      const int,
+                      const int,
+                      const float,
+                      const unsigned int,
+                      const float,
+                      const float>(),
+             "Load one headless simulation per file and insert k particles into each.",
+             "files"_a,
+             "cnt_particle"_a,
+             "image_width"_a,
+             "image_height"_a,
+             "dt"_a = 0.03f,
+             "threads"_a = 0,
+             "particle_radius"_a = SimulationSettings().particle_radius,
+             "particle_radius_stddev"_a = SimulationSettings().particle_radius_stddev)
+        .def("__len__", &PyBatchSimulation::size)
+        .def("step",
+             &PyBatchSimulation::step,
+             "Simulate all instances for the given time in parallel; row i of forces is the "
+             "force for instance i.",
+             "duration"_a,
+             "forces"_a,
+             py::call_guard<py::gil_scoped_release>())
+        .def("takeImages",
+             &PyBatchSimulation::takeImages,
+             "The images of all instances as one uint8 array (instances, 3 + slice_count, "
+             "height, width). Renders into 'out' if given; otherwise the array is overwritten "
+             "by the next call.",
+             "slice_count"_a,
+             "out"_a = py::none())
+        .def("positions",
+             &PyBatchSimulation::positions,
+             "Particle positions of every instance without a copy. The arrays keep their "
+             "instances alive (also after close()).",
+             "writable"_a = false)
+        .def("velocities",
+             &PyBatchSimulation::velocities,
+             "Particle velocities of every instance without a copy; see positions.",
+             "writable"_a = false)
+        .def("profile",
+             &PyBatchSimulation::profile,
+             "Simulation.profile() of every instance as list.")
+        .def("resetProfile",
+             &PyBatchSimulation::resetProfile,
+             py::call_guard<py::gil_scoped_release>())
+        .def("close", &PyBatchSimulation::close, py::call_guard<py::gil_scoped_release>())
+        .def("__enter__", [](py::object self) { return self; })
+        .def("__exit__", [](PyBatchSimulation& self, py::args) { self.close(); });
 }
 
 }  // namespace gathering
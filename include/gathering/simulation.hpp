@@ -1,7 +1,12 @@
 #ifndef GATHERING_SIMULATION_H
-#define GATHERING_SIMUALTION_H
+#define GATHERING_SIMULATION_H
 
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "gathering/glm_include.hpp"
@@ -25,19 +30,224 @@ struct Resolution {
     int height;
 };
 
+/**
+ * @brief How Simulation::take_images renders its images.
+ * OpenGL: rasterises the particle meshes with the gl context of the window.
+ * OpenGLLayered: renders offscreen into a layered framebuffer; all slices in one draw call.
+ * Software: splats the particles on the CPU; needs no gl context at all.
+ */
+enum class ImagingBackend { OpenGL, OpenGLLayered, Software };
+
+/**
+ * @brief How a step finds the pairs of particles that may touch.
+ * PerParticle: every particle looks up the 8 grid cells around it and keeps the particles
+ * with a larger index.
+ * CellPairs: every grid cell is paired with itself and the 13 neighbours that follow it (half
+ * shell); every pair is generated once without index comparisons, in parallel over the cells.
+ */
+enum class ParticleBroadPhase { PerParticle, CellPairs };
+
+/**
+ * @brief Pages of the large arrays of a simulation (particles, grid cells); Linux only.
+ * Off: normal pages.
+ * Transparent: the kernel is advised to back them with huge pages (THP), which need far
+ * fewer TLB entries.
+ * Explicit: reserved huge pages (vm.nr_hugepages); Transparent if there are none left.
+ */
+enum class HugePages { Off, Transparent, Explicit };
+
+/**
+ * @brief Channels take_images can produce per view, combined as bit mask. All requested
+ * channels are rendered in a single pass. Occupancy is always captured.
+ */
+namespace ImageChannel {
+constexpr unsigned int OCCUPANCY = 1u << 0;    // uint8: 255 where a particle is, else 0
+constexpr unsigned int DEPTH = 1u << 1;        // float: closest surface, [0, 1] = [near, far]
+constexpr unsigned int DENSITY = 1u << 2;      // float: number of particles covering the pixel
+constexpr unsigned int PARTICLE_ID = 1u << 3;  // uint32: index + 1 of the closest particle
+constexpr unsigned int ALL = OCCUPANCY | DEPTH | DENSITY | PARTICLE_ID;
+}  // namespace ImageChannel
+
 struct SimulationSettings {
     Resolution resolution = {1280, 720};
+    // radius of the particles. The step is compiled for a few common combinations of radius,
+    // restitution and drag (see physics.hpp); others use a generic, slightly slower version.
+    float particle_radius = 0.05f;
+    // > 0: the radius of every particle is drawn from a normal distribution (mean
+    // particle_radius, limited to a quarter up to four times of it). Images of such particles
+    // are rendered on the CPU; the window shows all of them with the mean radius.
+    float particle_radius_stddev = 0.f;
+    // of collisions between particles and with the vessel; 0 = inelastic, 1 = elastic
+    float restitution = 0.5f;
+    // the velocities are divided by this every step
+    float drag = 1.01f;
+    ParticleBroadPhase particle_broad_phase = ParticleBroadPhase::CellPairs;
+    // threads that search the particle pairs (CellPairs); 0 = number of hardware threads. The
+    // pairs are found in the same order for any number of threads.
+    unsigned int physics_threads = 1;
+    HugePages huge_pages = HugePages::Off;
+    // the physics threads are pinned to CPUs and write the pages of the particles and the
+    // grids first, each those of the particles it moves. Linux then places the pages on the
+    // NUMA node of that thread. Off: the allocating thread places all of them.
+    bool numa_first_touch = false;
+    // never create a window or gl context; images are rendered on the CPU. Always true if the
+    // library was built with GATHERING_HEADLESS.
+    bool headless = false;
+    // ignored if headless; the CPU is used then
+    ImagingBackend imaging = ImagingBackend::OpenGL;
+    // threads used by the software renderer; 0 = number of hardware threads
+    unsigned int imaging_threads = 0;
+    // multisampling of the offscreen images (ImagingBackend::OpenGL); 1 = no anti aliasing.
+    // Only the occupancy is multisampled; depth and density are rendered in a second pass
+    // without multisampling, so they aren't averaged by the resolve.
+    int samples = 4;
+    // ImageChannel mask. Depth and density are rendered with opengl or on the CPU; particle
+    // ids only on the CPU, so requesting them selects the software renderer.
+    unsigned int channels = ImageChannel::OCCUPANCY;
+    // draw the particles as ray-cast spheres (one point per particle) instead of meshes.
+    // Particles that would exceed the largest point size of the gpu are drawn as meshes.
+    bool impostors = false;
+    // if a window is shown, simulate on a worker thread while this thread renders the latest
+    // finished step at display rate
+    bool render_thread = false;
+    // if a window is shown, render only every n-th step (1 = every step)
+    unsigned int render_interval_steps = 1;
+    // if a window is shown, spend at most this many milliseconds per second of wall time on
+    // rendering; 0 = no limit
+    float render_budget_ms = 0.f;
+    // blend the particle positions between the last two rendered steps for a smooth display;
+    // needs render_thread
+    bool render_interpolation = false;
+    // record a timeline of the steps, their phases, rendering and image transfers of all
+    // threads and write the part of the latest run to this file (Chrome trace json, e.g. for
+    // ui.perfetto.dev) at the end of every runSteps/runTime/runStepsAsync. Simulations that
+    // run at the same time show up in it as well. Empty = no recording
+    std::string trace_file = "";
 };
 
 // ------------------------------------------------------------------------------------------------
 
+/**
+ * @brief The images of one capture in a single contiguous block. Every channel is stored as
+ * [count, height, width] (row major) and starts at a multiple of IMAGE_ALIGNMENT bytes; the
+ * channels follow each other in the order of their ImageChannel bits. The block is reused as
+ * long as it is large enough; a replaced block lives on as long as it is shared (shareBlock).
+ */
 struct ImageContainer {
-    std::vector<std::vector<unsigned char>> images;
-    size_t content_count = 0;
+    static constexpr size_t IMAGE_ALIGNMENT = 64;
+
+    size_t content_count = 0;  // number of images
+    size_t width = 0;
+    size_t height = 0;
+    unsigned int channels = ImageChannel::OCCUPANCY;
+
+    ImageContainer() = default;
+    ImageContainer(const ImageContainer& other);
+    ImageContainer& operator=(const ImageContainer& other);
+    ImageContainer(ImageContainer&& other) = default;
+    ImageContainer& operator=(ImageContainer&& other) = default;
+
+    size_t imageSize() const { return width * height; }
+    size_t byteSize() const { return content_count * imageSize(); }  // occupancy only
+    size_t blockSize() const;                                         // all channels
+    unsigned char* data() { return block.get(); }
+    const unsigned char* data() const { return block.get(); }
+    const unsigned char* image(const size_t i) const { return data() + i * imageSize(); }
+
+    /**
+     * @brief Owner of the current block, e.g. for arrays over the images: reset and free
+     * don't release the block while it is shared, but reset may overwrite it.
+     */
+    std::shared_ptr<unsigned char> shareBlock() const { return block; }
 
+    /**
+     * @brief Channels other than occupancy; nullptr if they were not captured.
+     */
+    const float* depth() const { return channel<float>(ImageChannel::DEPTH); }
+    const float* density() const { return channel<float>(ImageChannel::DENSITY); }
+    const uint32_t* ids() const { return channel<uint32_t>(ImageChannel::PARTICLE_ID); }
+
+    /**
+     * @brief Bytes from the start of the block to the given channel.
+     */
+    size_t channelOffset(const unsigned int channel) const;
+
+    /**
+     * @brief Makes room for count images of the given size. The contents are undefined.
+     */
+    void reset(const size_t width,
+               const size_t height,
+               const size_t count,
+               const unsigned int channels = ImageChannel::OCCUPANCY);
     void clear();
     void free();
-    void* data(const size_t size);
+
+   private:
+    template <typename T>
+    const T* channel(const unsigned int channel) const {
+        if ((channels & channel) == 0 || !block) return nullptr;
+        return reinterpret_cast<const T*>(block.get() + channelOffset(channel));
+    }
+
+    struct AlignedDelete {
+        void operator()(unsigned char* p) const;
+    };
+    std::shared_ptr<unsigned char> block;  // AlignedDelete
+    size_t capacity = 0;  // of the block in bytes
+};
+
+typedef std::function<void(const ImageContainer&)> ImageCallback;
+struct ImageView;
+struct ImageOutputs;
+struct SceneData;
+
+/**
+ * @brief Direct access to the state of all particles (no copy). Particle i starts at
+ * i * stride bytes after the pointers; position and velocity are 3 floats (x, y, z). The
+ * pointers are invalidated if particles are added and when the simulation is destroyed.
+ */
+struct ParticleArrays {
+    float* position = nullptr;
+    float* velocity = nullptr;
+    float* mass = nullptr;
+    float* radius = nullptr;  // read only; the particle grid depends on it
+    size_t count = 0;
+    size_t stride = 0;  // bytes from one particle to the next
+};
+
+/**
+ * @brief Where the time of the steps went, summed over all steps since the last
+ * resetProfile. Always collected; it costs a few clock reads per step.
+ */
+struct StepProfile {
+    size_t steps = 0;
+
+    // wall time of the phases of a step in microseconds
+    double integrate_us = 0.0;            // forces, speed limit and new positions
+    double grid_us = 0.0;                 // rebuilding the particle grid
+    double particle_collisions_us = 0.0;  // broad and narrow phase (interleaved per particle)
+    double particle_response_us = 0.0;
+    double vessel_broad_phase_us = 0.0;   // triangles whose bounding box overlaps a particle
+    double vessel_narrow_phase_us = 0.0;  // exact test and response per close triangle
+    double apply_us = 0.0;                // new velocities and drag
+
+    // wall time outside of the steps in microseconds
+    double render_us = 0.0;    // drawing the window
+    double images_us = 0.0;    // take_images (including the transfer of synchronous images)
+    double readback_us = 0.0;  // delivering the images of take_images_async
+
+    // events, summed over all steps
+    size_t particle_candidates = 0;  // pairs from the grid that were tested exactly
+    size_t particle_contacts = 0;    // intersecting pairs
+    size_t particle_responses = 0;   // intersecting pairs that moved towards each other
+    size_t vessel_candidates = 0;    // particle-triangle pairs with overlapping bounding boxes
+    size_t vessel_contacts = 0;      // intersecting particle-triangle pairs
+    size_t speed_clamps = 0;         // particles slowed down to the maximal speed
+
+    double stepUs() const {
+        return integrate_us + grid_us + particle_collisions_us + particle_response_us +
+               vessel_broad_phase_us + vessel_narrow_phase_us + apply_us;
+    }
 };
 
 class Simulation {
@@ -49,29 +259,122 @@ class Simulation {
     Simulation(const Simulation& a) = delete;
     Simulation& operator=(const Simulation& a) = delete;
 
+    /**
+     * @brief Adds about n particles, spread evenly over the cells of the vessel grid inside
+     * the vessel, at most one per cell. The actual number can be larger or, if the vessel has
+     * fewer inside cells than n, smaller; see particleArrays().count. n <= 0 adds none.
+     */
     void addParticles(const int n, const float mass_mean, const float mass_stddev);
     void showCurrentState();
     // TODO double for duration
     void runTime(const int milliseconds, ForceSchedule& schedule, const bool headless);
     void runSteps(const int n, ForceSchedule& schedule, const bool headless);
     void run(ForceSchedule& schedule, const bool headless);
+
+    /**
+     * @brief Runs n steps headless on a worker thread and returns immediately. All other
+     * member functions wait for the steps to finish first (see waitSteps).
+     */
+    void runStepsAsync(const int n, const ForceSchedule& schedule);
+    void waitSteps();
     ImageContainer& take_images(const int& slice_count);
+
+    /**
+     * @brief Same images as take_images, but written to the given memory, which must hold
+     * imageCount(slice_count) images of the size in the settings (e.g. a preallocated array
+     * of the caller).
+     */
+    void take_images(const int& slice_count, unsigned char* output);
+    static size_t imageCount(const int slice_count) { return 3 + std::max(0, slice_count); }
+
+    /**
+     * @brief Takes the same images at several resolutions; the n-th container belongs to the
+     * n-th resolution. The particles are uploaded only once for all resolutions.
+     */
+    std::vector<ImageContainer>& take_images(const int& slice_count,
+                                             const std::vector<Resolution>& resolutions);
+
+    /**
+     * @brief Same images as take_images, but the gpu copies them into pixel buffer objects
+     * asynchronously, so the simulation can go on while the images are transferred. Finished
+     * images are delivered during the following steps (or by wait_images) on the calling
+     * thread. Images rendered on the CPU are delivered immediately.
+     *
+     * The future is deferred: get() or wait() deliver the images themselves (wait_images),
+     * so they must be called on the thread that took the images, while the simulation
+     * exists. They throw std::runtime_error if the readback failed.
+     */
+    std::future<ImageContainer> take_images_async(const int& slice_count);
+    /**
+     * @brief As above; the callback isn't called if the readback fails.
+     */
+    void take_images_async(const int& slice_count, ImageCallback callback);
+
+    /**
+     * @brief Blocks until all images requested by take_images_async have been delivered.
+     * @throws std::runtime_error if a readback doesn't finish within 10 s, or if readbacks
+     * failed since the last call.
+     */
+    void wait_images();
+
+    /**
+     * @brief Waits for running steps and pending images, then destroys the window and the gl
+     * context, so the simulation only holds CPU memory, e.g. before another owner may destroy
+     * it on another thread. They are created again on next use.
+     * @throws std::runtime_error if called on another thread than the one that created
+     * them, or as wait_images; the context is released in the latter case anyway.
+     */
+    void releaseGL();
     const SimulationSettings& getSettings() const { return settings; };
+    ParticleArrays particleArrays();
 
-    float dt = 0.0;
+    /**
+     * @brief Changes how often runs with a window render (see SimulationSettings).
+     */
+    void setRenderPacing(const unsigned int interval_steps,
+                         const float budget_ms,
+                         const bool interpolation);
+
+    /**
+     * @brief Time per phase and event counts of all steps since the last resetProfile.
+     */
+    StepProfile profile();
+    void resetProfile();
+
+    /**
+     * @brief Changes the time step; waits for running steps first (see dt).
+     */
+    void setTimeStep(const float dt);
+
+    float dt = 0.0;  // must not be written directly while runStepsAsync is running
 
    private:
+    friend class SimulationBenchmark;  // times single phases of a step (src/benchmark)
+    SceneData& scene();
+
     // forward declarations
     struct SimulationImpl;
     std::unique_ptr<SimulationImpl> impl;
-    void Simulation::computeFrame(ForceSchedule& schedule,
-                                  const bool headless,
-                                  const size_t max_frame);
+    void computeFrame(ForceSchedule& schedule, const bool headless, const size_t max_frame);
+    void computeFrameThreaded(ForceSchedule& schedule, const size_t max_frame);
+    void step(ForceSchedule& schedule);
+    bool prepareDisplay(const bool headless);
+    bool prepareImaging(const std::vector<ImageView>& views);
+    void renderImages(const std::vector<ImageView>& views,
+                      const Resolution& resolution,
+                      const bool use_gl,
+                      const ImageOutputs& outputs);
     void update(const float dt);
+    template <typename Policy>  // see physics.hpp
+    void update(const Policy& physics, const float dt);
+    void dumpTrace();
     void findCollisionsParticles();
+    template <typename Policy>
+    void findCollisionsParticles(const Policy& physics);
     void findCollisionsTriangles();
     SimulationSettings settings;
-    ImageContainer images;
+    StepProfile step_profile;
+    std::vector<ImageContainer> image_sets;  // one per resolution
 };
 
 // ------------------------------------------------------------------------------------------------
@@ -3,25 +3,37 @@ layout (location = 0) in vec3 coord3d;
 layout (location = 1) in vec4 v_color;
 layout (location = 2) in vec2 texcoord;
 layout (location = 3) in vec3 normal;
-layout (location = 4) in mat4 transformation;
+layout (location = 4) in vec4 instance; // position + scalar
 
 layout (std140) uniform Global{	
     mat4 view; 
     mat4 projection;
     vec3 light_source;
+    vec4 viewport;  // x, y, width, height
+    mat4 inverse_projection;
 };
 
+uniform int colorize = 0;  // color by the scalar of the instance
+uniform vec2 scalar_range = vec2(0.0, 1.0);
+
 out vec4 f_color;
 out vec4 f_normal;
 out vec3 f_coord3d;
 out vec2 f_texcoord;
+flat out vec3 f_center;  // of the instance (eye space)
 
 void main(void) {
-    vec4 camera_coords = transformation * vec4(coord3d, 1.0);
+    vec4 camera_coords = vec4(coord3d + instance.xyz, 1.0);
     gl_Position = projection * view * camera_coords;
+    gl_PointSize = 1.0;  // coarsest level of detail
 
 	f_color = v_color;
+    if (colorize != 0) {
+        float t = (instance.w - scalar_range.x) / max(scalar_range.y - scalar_range.x, 1e-6);
+        f_color.rgb = mix(vec3(0.2, 0.4, 1.0), vec3(1.0, 0.3, 0.1), clamp(t, 0.0, 1.0));
+    }
     f_texcoord = texcoord;
     f_normal = vec4(normal, 0);
 	f_coord3d = camera_coords.xyz;
+    f_center = (view * vec4(instance.xyz, 1.0)).xyz;
 }
@@ -0,0 +1,68 @@
+#version 460
+
+in vec4 f_color;
+flat in vec3 f_center;
+
+layout (location = 0) out vec4 output_color;
+layout (location = 1) out float output_depth;    // min blended; only in image captures
+layout (location = 2) out float output_density;  // add blended; only in image captures
+
+layout (std140) uniform Global{	
+    mat4 view;
+    mat4 projection;
+    vec3 light_source;
+    vec4 viewport;  // x, y, width, height
+    mat4 inverse_projection;
+};
+
+uniform float radius;
+uniform int shaded = 1;
+
+void main(void) {
+    // ray through this pixel from the near to the far plane (eye space)
+    vec2 ndc = (gl_FragCoord.xy - viewport.xy) / viewport.zw * 2.0 - 1.0;
+    vec4 near = inverse_projection * vec4(ndc, -1.0, 1.0);
+    vec4 far = inverse_projection * vec4(ndc, 1.0, 1.0);
+    vec3 origin = near.xyz / near.w;
+    vec3 direction = far.xyz / far.w - origin;
+    float len = length(direction);
+    direction /= len;
+
+    // intersect the sphere; the part in front of the near plane is cut away
+    vec3 oc = origin - f_center;
+    float b = dot(oc, direction);
+    float h = b * b - dot(oc, oc) + radius * radius;
+    if (h < 0.0) discard;
+    h = sqrt(h);
+    if (-b + h < 0.0 || -b - h > len) discard;
+    vec3 hit = origin + max(-b - h, 0.0) * direction;
+
+    vec4 clip = projection * vec4(hit, 1.0);
+    gl_FragDepth = 0.5 * (gl_DepthRange.diff * clip.z / clip.w + gl_DepthRange.near +
+                          gl_DepthRange.far);
+    output_depth = gl_FragDepth;
+    output_density = 1.0;
+
+    if (shaded == 0) {
+        output_color = f_color;
+        return;
+    }
+
+    // same shading as shaded.frag
+    float occ = f_color.a;
+    float ambient = 0.2;
+    vec3 N = (hit - f_center) / radius;
+    vec3 L = (view * vec4(light_source, 1.0)).xyz - hit; // light source
+    L = normalize(L);
+
+    // shade objects from inside the same as from outside
+    float lambertian = abs(dot(N, L));
+
+    vec3 diffuse_color = f_color.xyz;
+    vec3 light_color = vec3(1.0) * 0.75;
+
+    vec3 color = vec3(0.0);
+    color += diffuse_color * ambient; // ambient
+    color += diffuse_color * lambertian * light_color; // diffuse
+    output_color = vec4(color, occ);
+}
@@ -0,0 +1,40 @@
+#version 460
+layout (location = 0) in vec3 coord3d;
+layout (location = 1) in vec4 v_color;
+layout (location = 4) in vec4 instance; // position + scalar
+
+layout (std140) uniform Global{	
+    mat4 view; 
+    mat4 projection;
+    vec3 light_source;
+    vec4 viewport;  // x, y, width, height
+    mat4 inverse_projection;
+};
+
+uniform float radius;
+uniform int colorize = 0;  // color by the scalar of the instance
+uniform vec2 scalar_range = vec2(0.0, 1.0);
+
+out vec4 f_color;
+flat out vec3 f_center;  // eye space
+
+// one point per particle; the sphere is ray-cast in the fragment shader
+void main(void) {
+    vec4 center = view * vec4(coord3d + instance.xyz, 1.0);
+    gl_Position = projection * center;
+
+    // keep spheres that are cut by the near or far plane, the fragment shader clips them
+    gl_Position.z = clamp(gl_Position.z, -gl_Position.w, gl_Position.w);
+
+    // projected diameter in pixels, with a margin for the perspective distortion
+    float scale = max(projection[0][0] * viewport.z, projection[1][1] * viewport.w);
+    float diameter = radius * scale;
+    gl_PointSize = 1.25 * diameter / gl_Position.w + 2.0;
+
+    f_center = center.xyz;
+    f_color = v_color;
+    if (colorize != 0) {
+        float t = (instance.w - scalar_range.x) / max(scalar_range.y - scalar_range.x, 1e-6);
+        f_color.rgb = mix(vec3(0.2, 0.4, 1.0), vec3(1.0, 0.3, 0.1), clamp(t, 0.0, 1.0));
+    }
+}
@@ -0,0 +1,9 @@
+#version 460
+
+in vec4 f_color;
+
+out vec4 output_color;
+
+void main(void) {
+    output_color = f_color;
+}
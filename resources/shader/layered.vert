@@ -0,0 +1,12 @@
+#version 460
+layout (location = 0) in vec3 coord3d;
+layout (location = 1) in vec4 v_color;
+layout (location = 4) in vec4 instance; // position + scalar
+
+out vec4 g_color;
+
+// world coordinates; view and projection are applied per layer in the geometry shader
+void main(void) {
+    gl_Position = vec4(coord3d + instance.xyz, 1.0);
+    g_color = v_color;
+}
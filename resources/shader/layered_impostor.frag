@@ -0,0 +1,23 @@
+#version 460
+
+in vec4 f_color;
+flat in vec3 f_center;  // normalized device coordinates
+flat in vec3 f_radii;   // normalized device coordinates
+
+uniform vec4 viewport;  // x, y, width, height
+
+out vec4 output_color;
+
+// cuts the ellipsoid (see layered_impostor.geom) with the depth range of the layer
+void main(void) {
+    vec2 ndc = (gl_FragCoord.xy - viewport.xy) / viewport.zw * 2.0 - 1.0;
+    vec2 d = (ndc - f_center.xy) / f_radii.xy;
+    float q = 1.0 - dot(d, d);
+    if (q < 0.0) discard;
+
+    float half_depth = f_radii.z * sqrt(q);
+    if (f_center.z + half_depth < -1.0 || f_center.z - half_depth > 1.0) discard;
+    float z = max(f_center.z - half_depth, -1.0);
+    gl_FragDepth = 0.5 * (gl_DepthRange.diff * z + gl_DepthRange.near + gl_DepthRange.far);
+    output_color = f_color;
+}
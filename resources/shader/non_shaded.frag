@@ -4,15 +4,43 @@ in vec4 f_color;
 in vec4 f_normal;
 in vec3 f_coord3d;
 in vec2 f_texcoord;
+flat in vec3 f_center;  // of the particle (eye space)
 
-out vec4 output_color;
+layout (location = 0) out vec4 output_color;
+layout (location = 1) out float output_depth;    // min blended; only in image captures
+layout (location = 2) out float output_density;  // add blended; only in image captures
 
 layout (std140) uniform Global{	
     mat4 view;
     mat4 projection;
     vec3 light_source;
+    vec4 viewport;  // x, y, width, height
+    mat4 inverse_projection;
 };
 
+uniform float radius;
+
+// Image captures draw the particle meshes with depth clamping and without back faces: every
+// particle has a single fragment per pixel, also if the near plane cuts it. Its chord along
+// the ray through the pixel, clipped to the near and far plane, decides whether it is in the
+// view.
 void main(void) {
+    // ray through this pixel from the near to the far plane (eye space)
+    vec2 ndc = (gl_FragCoord.xy - viewport.xy) / viewport.zw * 2.0 - 1.0;
+    vec4 near = inverse_projection * vec4(ndc, -1.0, 1.0);
+    vec4 far = inverse_projection * vec4(ndc, 1.0, 1.0);
+    vec3 origin = near.xyz / near.w;
+    vec3 direction = far.xyz / far.w - origin;
+    float len = length(direction);
+    direction /= len;
+
+    // the mesh lies within the sphere, so rays through it meet the sphere (up to rounding)
+    vec3 oc = origin - f_center;
+    float b = dot(oc, direction);
+    float h = sqrt(max(b * b - dot(oc, oc) + radius * radius, 0.0));
+    if (-b + h < 0.0 || -b - h > len) discard;
+
     output_color = f_color;  
+    output_depth = gl_FragCoord.z;  // clamped to the near plane if it cuts the particle
+    output_density = 1.0;
 }
@@ -11,6 +11,8 @@ layout (std140) uniform Global{
     mat4 view;
     mat4 projection;
     vec3 light_source;
+    vec4 viewport;  // x, y, width, height
+    mat4 inverse_projection;
 };
 
 void main(void) {
@@ -0,0 +1,180 @@
+#ifndef GATHERING_BENCHMARK_H
+#define GATHERING_BENCHMARK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace gathering {
+namespace Benchmark {
+
+/**
+ * @brief Passed to every benchmark (similar to benchmark::State of Google Benchmark). The
+ * timed part is the body of 'while (state.keepRunning())'; setup inside the loop can be
+ * excluded with pauseTiming/resumeTiming.
+ */
+class State {
+   public:
+    State(const long long argument, const size_t iterations)
+        : argument(argument), iterations(iterations) {}
+
+    bool keepRunning() {
+        if (done == 0) {
+            t_start = Clock::now();
+        }
+        if (done == iterations) {
+            elapsed += Clock::now() - t_start;
+            return false;
+        }
+        ++done;
+        return true;
+    }
+
+    void pauseTiming() { elapsed += Clock::now() - t_start; }
+    void resumeTiming() { t_start = Clock::now(); }
+
+    long long range() const { return argument; }
+    size_t iterationCount() const { return iterations; }
+    double seconds() const { return std::chrono::duration<double>(elapsed).count(); }
+
+    // processed elements per iteration, reported as throughput
+    void setItemsProcessed(const long long items) { items_processed = items; }
+    long long itemsProcessed() const { return items_processed; }
+
+    // reported instead of the argument, e.g. if the benchmark couldn't use it exactly
+    void setLabel(const std::string& text) { label_text = text; }
+    const std::string& label() const { return label_text; }
+
+   private:
+    using Clock = std::chrono::steady_clock;
+    long long argument;
+    size_t iterations;
+    size_t done = 0;
+    long long items_processed = 0;
+    std::string label_text;
+    Clock::time_point t_start;
+    Clock::duration elapsed = Clock::duration::zero();
+};
+
+typedef std::function<void(State&)> Function;
+
+struct Entry {
+    std::string name;
+    Function function;
+    std::vector<long long> arguments;  // one run per argument; empty = one run without
+};
+
+inline std::vector<Entry>& registry() {
+    static std::vector<Entry> entries;
+    return entries;
+}
+
+inline void add(const std::string& name,
+                Function function,
+                const std::vector<long long>& arguments = {}) {
+    registry().push_back({name, function, arguments});
+}
+
+// ------------------------------------------------------------------------------------------------
+
+inline std::string formatTime(const double seconds) {
+    char buffer[32];
+    if (seconds >= 1.0) {
+        snprintf(buffer, sizeof(buffer), "%10.3f s ", seconds);
+    } else if (seconds >= 1e-3) {
+        snprintf(buffer, sizeof(buffer), "%10.3f ms", seconds * 1e3);
+    } else {
+        snprintf(buffer, sizeof(buffer), "%10.3f us", seconds * 1e6);
+    }
+    return buffer;
+}
+
+/**
+ * @brief Runs every registered benchmark whose name contains the filter. The iterations are
+ * increased until a run takes at least min_time seconds (at least one iteration). The filter
+ * matches the name with the argument; the results show the label instead if one was set.
+ * Arguments: --filter=<substring> --min_time=<seconds> --csv
+ */
+inline int run(int argc, char** argv) {
+    std::string filter = "";
+    double min_time = 0.5;
+    bool csv = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--filter=", 0) == 0) {
+            filter = arg.substr(9);
+        } else if (arg.rfind("--min_time=", 0) == 0) {
+            min_time = atof(arg.substr(11).c_str());
+        } else if (arg == "--csv") {
+            csv = true;
+        } else {
+            printf("Usage: %s [--filter=<substring>] [--min_time=<seconds>] [--csv]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+
+    if (csv) {
+        printf("name,iterations,seconds_per_iteration,items_per_second\n");
+    } else {
+        printf("%-40s %13s %12s %14s\n", "Benchmark", "Time", "Iterations", "Items/s");
+        printf("%s\n", std::string(82, '-').c_str());
+    }
+
+    for (const Entry& entry : registry()) {
+        std::vector<long long> arguments = entry.arguments;
+        if (arguments.empty()) arguments.push_back(0);
+        for (const long long argument : arguments) {
+            std::string name = entry.name;
+            if (!entry.arguments.empty()) name += "/" + std::to_string(argument);
+            if (name.find(filter) == std::string::npos) continue;
+
+            size_t iterations = 1;
+            State state(argument, iterations);
+            while (true) {
+                state = State(argument, iterations);
+                entry.function(state);
+                if (state.seconds() >= min_time || iterations >= 1000000000) break;
+                // aim for the minimal time with some margin, but grow at most 10x at once
+                double factor = 10.0;
+                if (state.seconds() > 0.0) factor = 1.4 * min_time / state.seconds();
+                factor = std::min(10.0, std::max(2.0, factor));
+                iterations = static_cast<size_t>(iterations * factor);
+            }
+
+            if (!state.label().empty()) name = entry.name + "/" + state.label();
+            double per_iteration = state.seconds() / state.iterationCount();
+            double items = state.itemsProcessed() / per_iteration;
+            if (csv) {
+                printf("%s,%zu,%.9g,%.6g\n",
+                       name.c_str(),
+                       state.iterationCount(),
+                       per_iteration,
+                       state.itemsProcessed() > 0 ? items : 0.0);
+            } else if (state.itemsProcessed() > 0) {
+                printf("%-40s %s %12zu %12.4gM\n",
+                       name.c_str(),
+                       formatTime(per_iteration).c_str(),
+                       state.iterationCount(),
+                       items * 1e-6);
+            } else {
+                printf("%-40s %s %12zu\n",
+                       name.c_str(),
+                       formatTime(per_iteration).c_str(),
+                       state.iterationCount());
+            }
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
+
+}  // namespace Benchmark
+}  // namespace gathering
+
+#endif
@@ -0,0 +1,227 @@
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "benchmark.hpp"
+#include "gathering/simulation.hpp"
+#include "instance_generator/voxel_vessel.hpp"
+#include "scene.hpp"
+
+namespace gathering {
+
+/**
+ * @brief Runs single phases of Simulation::update on their own.
+ */
+class SimulationBenchmark {
+   public:
+    static SceneData& scene(Simulation& simulation) { return simulation.scene(); }
+
+    static void findCollisionsParticles(Simulation& simulation) {
+        simulation.scene().collisions_particle.clear();
+        simulation.findCollisionsParticles();
+    }
+
+    static void findCollisionsTriangles(Simulation& simulation) {
+        simulation.findCollisionsTriangles();
+    }
+
+    static void clearCollisionsTriangles(Simulation& simulation) {
+        SceneData& scene = simulation.scene();
+        scene.collisions_vessel.clear();
+        for (auto& particle : scene.particles) particle.close_triangles.clear();
+    }
+};
+
+}  // namespace gathering
+
+// ------------------------------------------------------------------------------------------------
+
+namespace {
+
+using namespace gathering;
+
+const std::vector<long long> PARTICLE_COUNTS = {1000, 10000, 100000, 1000000};
+const ForceSchedule GRAVITY = {{1e9, Direction::DOWN * 0.1f}};
+
+/**
+ * @brief Writes the vessel into the temp directory and returns the path of the file. The obj
+ * is generated on every run and named by a hash of its content; an existing file is only
+ * reused if it has exactly this content, so a stale or partial one is written again.
+ */
+std::string vesselFile(const std::string& name, const InstanceGenerator::VoxelVessel& vessel) {
+    std::ostringstream obj;
+    InstanceGenerator::writeObj(vessel, obj);
+    const std::string content = obj.str();
+
+    char hash[17];
+    snprintf(hash,
+             sizeof(hash),
+             "%016llx",
+             static_cast<unsigned long long>(std::hash<std::string>()(content)));
+    std::filesystem::path path = std::filesystem::temp_directory_path() /
+                                 ("gathering_bench_" + name + "_" + hash + ".obj");
+    std::ifstream existing(path, std::ios::binary);
+    std::string existing_content{std::istreambuf_iterator<char>(existing),
+                                 std::istreambuf_iterator<char>()};
+    if (existing_content != content) {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file << content;
+        if (!file) throw std::runtime_error("Can't write " + path.string());
+    }
+    return path.string();
+}
+
+// the vessel grid takes at most one new particle per cell, so the runs are labeled with the
+// number of particles that were actually added instead of the requested one
+void setParticleCount(Benchmark::State& state, const size_t particles) {
+    state.setItemsProcessed(static_cast<long long>(particles));
+    state.setLabel(std::to_string(particles));
+}
+
+/**
+ * @brief Box vessel that holds the given number of particles with about two diameters
+ * between them, so all particle counts have a comparable density.
+ */
+std::string boxFor(const long long particles) {
+    int size = std::max(4, static_cast<int>(std::ceil(std::cbrt(double(particles)) * 0.2)));
+    return vesselFile("box" + std::to_string(size), InstanceGenerator::box(size, size, size));
+}
+
+std::unique_ptr<Simulation> simulationFor(const long long particles,
+                                          SimulationSettings settings = SimulationSettings()) {
+    settings.headless = true;
+    settings.resolution = {300, 200};
+    auto simulation = std::make_unique<Simulation>(boxFor(particles).c_str(), 0.03f, settings);
+    simulation->addParticles(static_cast<int>(particles), 1.0f, 0.01f);
+    return simulation;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void loadObj(Benchmark::State& state) {
+    const int size = static_cast<int>(state.range());
+    std::string file =
+        vesselFile("box" + std::to_string(size), InstanceGenerator::box(size, size, size));
+    size_t triangles = 0;
+    while (state.keepRunning()) {
+        SceneData scene(file.c_str());
+        triangles = scene.triangles.size();
+    }
+    state.setItemsProcessed(triangles);
+}
+
+void loadCubeCross(Benchmark::State& state) {
+    std::string file = vesselFile("cube_cross", InstanceGenerator::cubeCross());
+    while (state.keepRunning()) SceneData scene(file.c_str());
+}
+
+void addParticles(Benchmark::State& state) {
+    std::string file = boxFor(state.range());
+    size_t particles = 0;
+    while (state.keepRunning()) {
+        state.pauseTiming();
+        SceneData scene(file.c_str());
+        state.resumeTiming();
+        scene.addParticles(static_cast<int>(state.range()), 1.0f, 0.01f);
+        particles = scene.particles.size();
+    }
+    setParticleCount(state, particles);
+}
+
+void step(Benchmark::State& state) {
+    auto simulation = simulationFor(state.range());
+    ForceSchedule schedule = GRAVITY;
+    while (state.keepRunning()) simulation->runSteps(1, schedule, true);
+    setParticleCount(state, simulation->particleArrays().count);
+}
+
+// a radius without precompiled step: the generic kernels (see physics.hpp)
+void stepGeneric(Benchmark::State& state) {
+    SimulationSettings settings;
+    settings.particle_radius = std::nextafter(settings.particle_radius, 1.f);
+    auto simulation = simulationFor(state.range(), settings);
+    ForceSchedule schedule = GRAVITY;
+    while (state.keepRunning()) simulation->runSteps(1, schedule, true);
+    setParticleCount(state, simulation->particleArrays().count);
+}
+
+// radii of 1/4 to 4 times the mean: several levels of the particle grid
+void stepPolydisperse(Benchmark::State& state) {
+    SimulationSettings settings;
+    settings.particle_radius_stddev = settings.particle_radius * 0.3f;
+    auto simulation = simulationFor(state.range(), settings);
+    ForceSchedule schedule = GRAVITY;
+    while (state.keepRunning()) simulation->runSteps(1, schedule, true);
+    setParticleCount(state, simulation->particleArrays().count);
+}
+
+void broadPhaseParticles(Benchmark::State& state, const ParticleBroadPhase broad_phase) {
+    SimulationSettings settings;
+    settings.particle_broad_phase = broad_phase;
+    auto simulation = simulationFor(state.range(), settings);
+    ForceSchedule schedule = GRAVITY;
+    simulation->runSteps(1, schedule, true);  // fills the particle grid
+    while (state.keepRunning()) SimulationBenchmark::findCollisionsParticles(*simulation);
+    setParticleCount(state, simulation->particleArrays().count);
+}
+
+void broadPhaseCellPairs(Benchmark::State& state) {
+    broadPhaseParticles(state, ParticleBroadPhase::CellPairs);
+}
+
+void broadPhasePerParticle(Benchmark::State& state) {
+    broadPhaseParticles(state, ParticleBroadPhase::PerParticle);
+}
+
+void broadPhaseVessel(Benchmark::State& state) {
+    auto simulation = simulationFor(state.range());
+    ForceSchedule schedule = GRAVITY;
+    simulation->runSteps(1, schedule, true);
+    while (state.keepRunning()) {
+        state.pauseTiming();
+        SimulationBenchmark::clearCollisionsTriangles(*simulation);
+        state.resumeTiming();
+        SimulationBenchmark::findCollisionsTriangles(*simulation);
+    }
+    SimulationBenchmark::clearCollisionsTriangles(*simulation);
+    setParticleCount(state, simulation->particleArrays().count);
+}
+
+void takeImages(Benchmark::State& state) {
+    auto simulation = simulationFor(state.range());
+    while (state.keepRunning()) simulation->take_images(8);
+    setParticleCount(state, simulation->particleArrays().count);
+}
+
+}  // namespace
+
+// ------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Benchmarks of the simulation on procedurally generated vessels (no assets needed).
+ * Images are rendered on the CPU, no window is created.
+ * Usage: gathering_bench [--filter=<substring>] [--min_time=<seconds>] [--csv]
+ */
+int main(int argc, char** argv) {
+    std::cout.setstate(std::ios::failbit);  // progress output of the library
+
+    Benchmark::add("LoadObj/cube_cross", loadCubeCross);
+    Benchmark::add("LoadObj/box", loadObj, {4, 16, 64});
+    Benchmark::add("AddParticles", addParticles, PARTICLE_COUNTS);
+    Benchmark::add("Step", step, PARTICLE_COUNTS);
+    Benchmark::add("Step/generic", stepGeneric, PARTICLE_COUNTS);
+    Benchmark::add("Step/polydisperse", stepPolydisperse, PARTICLE_COUNTS);
+    Benchmark::add("BroadPhase/particles", broadPhaseCellPairs, PARTICLE_COUNTS);
+    Benchmark::add(
+        "BroadPhase/particles/per_particle", broadPhasePerParticle, PARTICLE_COUNTS);
+    Benchmark::add("BroadPhase/vessel", broadPhaseVessel, PARTICLE_COUNTS);
+    Benchmark::add("TakeImages/software", takeImages, PARTICLE_COUNTS);
+    return Benchmark::run(argc, argv);
+}
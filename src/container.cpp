@@ -1,12 +1,42 @@
 #include "container.hpp"
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <iostream>
 
 namespace gathering {
 
-Grid::Grid(const vec3i& resolution, const AABB& aabb) : resolution(resolution), aabb(aabb) {
+// the neighbours that follow a cell in memory order (x fastest)
+const vec3i Grid::HALF_SHELL[13] = {vec3i(1, 0, 0),
+                                    vec3i(-1, 1, 0),
+                                    vec3i(0, 1, 0),
+                                    vec3i(1, 1, 0),
+                                    vec3i(-1, -1, 1),
+                                    vec3i(0, -1, 1),
+                                    vec3i(1, -1, 1),
+                                    vec3i(-1, 0, 1),
+                                    vec3i(0, 0, 1),
+                                    vec3i(1, 0, 1),
+                                    vec3i(-1, 1, 1),
+                                    vec3i(0, 1, 1),
+                                    vec3i(1, 1, 1)};
+
+Grid::Grid(const vec3i& resolution, const AABB& aabb, const Memory::Placement& placement)
+    : resolution(resolution), aabb(aabb) {
     size = aabb.max - aabb.min;
-    grid = IDXList3D(resolution.x, resolution.y, resolution.z, GridCell());
+    grid = IDXList3D(resolution.x,
+                     resolution.y,
+                     resolution.z,
+                     GridCell(),
+                     1,
+                     OutOfDomain::Clamp,
+                     placement);
+    occupancy = decltype(occupancy)(grid.storageSize(),
+                                    0,  // the halo stays empty
+                                    Memory::LargeAllocator<uint8_t>(placement));
+    for (int i = 0; i < 13; ++i) half_shell[i] = grid.offset(HALF_SHELL[i]);
+    blocks = (resolution + BLOCK - 1) / BLOCK;
 
     cell_size = size / (glm::vec3)resolution;
     cell_radius = cell_size / 2.0f;
@@ -30,7 +60,7 @@ Grid::Grid(const vec3i& resolution, const AABB& aabb) : resolution(resolution),
         for (int x = -1 + offset_x; x < 1 + offset_x; ++x) {
             for (int y = -1 + offset_y; y < 1 + offset_y; ++y) {
                 for (int z = -1 + offset_z; z < 1 + offset_z; ++z) {
-                    neighbours[i].push_back(glm::vec3(x, y, z));
+                    neighbours[i].push_back(vec3i(x, y, z));
                 }
             }
         }
@@ -38,17 +68,49 @@ Grid::Grid(const vec3i& resolution, const AABB& aabb) : resolution(resolution),
 }
 
 vec3i Grid::coords(const glm::vec3& pos) const {
-    // TODO point in AABB of vessel??
-    return ((pos - aabb.min) * (glm::vec<3, float>)resolution) / size;
+    return grid.clamp(((pos - aabb.min) * (glm::vec<3, float>)resolution) / size);
 }
 
-void Grid::insert(const glm::vec3& pos, size_t idx) {
-    grid.at(coords(pos)).content.push_back(idx);
+void Grid::insert(const glm::vec3& pos, size_t idx) { insert(coords(pos), idx); }
+
+void Grid::insert(const vec3i& coords, size_t idx) {
+    const vec3i cell = grid.clamp(coords);
+    const size_t index = grid.index(cell);
+    std::vector<size_t>& content = grid[index].content;
+    if (content.empty()) {
+        const vec3i block = cell / BLOCK;
+        occupied.push_back(index);
+        occupied_blocks.push_back(
+            uint32_t(block.x + blocks.x * (block.y + size_t(blocks.y) * block.z)));
+        occupancy[index] = 1;
+    }
+    content.push_back(idx);
 }
 
-void Grid::insert(const vec3i& coords, size_t idx) { grid.at(coords).content.push_back(idx); }
+void Grid::clear() {
+    for (const size_t index : occupied) {
+        grid[index].content.clear();
+        occupancy[index] = 0;
+    }
+    occupied.clear();
+    occupied_blocks.clear();
+}
 
-void Grid::clear(const vec3i& coords) { grid.at(coords).content.clear(); }
+void Grid::sortOccupied() {
+    block_starts.assign(size_t(blocks.x) * blocks.y * blocks.z + 1, 0);
+    for (const uint32_t block : occupied_blocks) ++block_starts[block + 1];
+    for (size_t b = 1; b < block_starts.size(); ++b) block_starts[b] += block_starts[b - 1];
+
+    sorted.resize(occupied.size());
+    sorted_blocks.resize(occupied.size());
+    for (size_t i = 0; i < occupied.size(); ++i) {
+        const size_t position = block_starts[occupied_blocks[i]]++;
+        sorted[position] = occupied[i];
+        sorted_blocks[position] = occupied_blocks[i];
+    }
+    std::swap(occupied, sorted);
+    std::swap(occupied_blocks, sorted_blocks);
+}
 
 const glm::vec3& Grid::cellCenter(const vec3i& coords) const { return grid.at(coords).center; }
 
@@ -56,8 +118,9 @@ void Grid::closeUniqueElements(const vec3i& coords,
                                const size_t& self_idx,
                                const int neighbours_idx,
                                std::vector<size_t>& output) {
+    assert(grid.contains(coords));
     for (const vec3i& offset : neighbours[neighbours_idx]) {
-        const GridCell& cell = grid.at(coords + offset);
+        const GridCell& cell = grid.unchecked(coords + offset);
         for (const size_t& e : cell.content) {
             if (e > self_idx)
                 output.push_back(
@@ -66,4 +129,97 @@ void Grid::closeUniqueElements(const vec3i& coords,
     }
 }
 
+void Grid::closeElements(const vec3i& coords,
+                         const int neighbours_idx,
+                         std::vector<size_t>& output) const {
+    assert(grid.contains(coords));
+    for (const vec3i& offset : neighbours[neighbours_idx]) {
+        const GridCell& cell = grid.unchecked(coords + offset);
+        output.insert(output.end(), cell.content.begin(), cell.content.end());
+    }
+}
+
+void Grid::neighbourElements(const vec3i& coords, std::vector<size_t>& output) const {
+    assert(grid.contains(coords));
+    for (int z = -1; z <= 1; ++z) {
+        for (int y = -1; y <= 1; ++y) {
+            for (int x = -1; x <= 1; ++x) {
+                const GridCell& cell = grid.unchecked(coords + vec3i(x, y, z));
+                output.insert(output.end(), cell.content.begin(), cell.content.end());
+            }
+        }
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+HierarchicalGrid::HierarchicalGrid(const AABB& aabb,
+                                   const float min_radius,
+                                   const float max_radius,
+                                   const float cell_radii,
+                                   const Memory::Placement& placement)
+    : cell_radii(cell_radii) {
+    assert(cell_radii >= 2.f);
+    // finest level: cell_radii radii of the smallest particle, but a limited number of cells
+    glm::vec3 size = aabb.max - aabb.min;
+    float volume = size.x * size.y * size.z;
+    min_cell_size =
+        std::max(min_radius * cell_radii, std::cbrt(volume / MAX_CELLS_PER_LEVEL));
+
+    size_t count = 1;
+    while (min_cell_size * float(1 << (count - 1)) < max_radius * cell_radii) ++count;
+    levels = std::vector<Grid>(count);
+    for (size_t l = 0; l < count; ++l) {
+        vec3i resolution = size / glm::vec3(min_cell_size * float(1 << l));
+        levels[l] = Grid(glm::max(resolution, vec3i(1)), aabb, placement);
+    }
+}
+
+int HierarchicalGrid::level(const float radius) const {
+    int l = 0;
+    while (l + 1 < int(levels.size()) && min_cell_size * float(1 << l) < radius * cell_radii) {
+        ++l;
+    }
+    return l;
+}
+
+namespace {
+
+// which of the 8 groups of neighbouring cells has to be checked for the position
+int neighbourIndex(const Grid& grid, const vec3i& cell, const glm::vec3& pos) {
+    glm::vec3 deviation = pos - grid.cellCenter(cell);
+    int neighbour_index = 0;
+    if (deviation.x > 0.0f) neighbour_index |= 1;
+    if (deviation.y > 0.0f) neighbour_index |= 2;
+    if (deviation.z > 0.0f) neighbour_index |= 4;
+    return neighbour_index;
+}
+
+}  // namespace
+
+void HierarchicalGrid::closeElements(const glm::vec3& pos,
+                                     const int level,
+                                     const vec3i& coords,
+                                     const size_t self_idx,
+                                     std::vector<size_t>& output) {
+    Grid& grid = levels[level];
+    grid.closeUniqueElements(coords, self_idx, neighbourIndex(grid, coords, pos), output);
+    coarserElements(pos, level, output);
+}
+
+void HierarchicalGrid::coarserElements(const glm::vec3& pos,
+                                       const int level,
+                                       std::vector<size_t>& output) {
+    // all elements are larger; they don't look at this level, so report them all
+    for (size_t l = level + 1; l < levels.size(); ++l) {
+        const Grid& grid = levels[l];
+        vec3i cell = grid.coords(pos);
+        if (cell_radii >= 4.f) {
+            grid.closeElements(cell, neighbourIndex(grid, cell, pos), output);
+        } else {
+            grid.neighbourElements(cell, output);  // partners up to a cell away
+        }
+    }
+}
+
 }  // namespace gathering
@@ -1,60 +1,143 @@
 #ifndef GATHERING_CONTAINER_H
 #define GATHERING_CONTAINER_H
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <vector>
 
 #include "gathering/glm_include.hpp"
+#include "memory.hpp"
 #include "particle.hpp"  // AABB
 
 namespace gathering {
 
+/**
+ * @brief What Array3D::at does with coordinates outside of the array.
+ * Clamp: uses the closest cell of the array.
+ * Reject: returns the error element. A written one is a copy per thread that is reset on
+ * every such access, so writes are discarded instead of merging all outside elements into one
+ * shared cell, also if several threads write outside at once.
+ * Count: as Reject; the accesses are counted atomically (outOfDomainCount), as are the boxes
+ * of countOutside.
+ */
+enum class OutOfDomain { Clamp, Reject, Count };
+
+/**
+ * @brief Dense 3D array, x fastest. It can be padded with halo layers of default elements
+ * on all sides: unchecked accepts -halo <= coordinate < size + halo without any check, so
+ * kernels can read the neighbours of every cell directly. at checks the coordinates against
+ * the size and applies the out-of-domain policy. The storage is placed as given (see
+ * Memory::allocate).
+ */
 template <typename T>
 class Array3D {
    public:
-    Array3D(size_t size_x, size_t size_y, size_t size_z, const T& error_element)
-        : sx(size_x), sy(size_y), sz(size_z), error_element(error_element) {
-        b_x = size_x;
-        b_xy = size_x * size_y;
-        data = std::shared_ptr<T[]>(new T[size_x * size_y * size_z]);
+    Array3D(const int size_x,
+            const int size_y,
+            const int size_z,
+            const T& default_element,
+            const int halo = 0,
+            const OutOfDomain policy = OutOfDomain::Reject,
+            const Memory::Placement& placement = Memory::Placement())
+        : size(size_x, size_y, size_z),
+          halo(halo),
+          policy(policy),
+          error_element(default_element) {
+        b_x = size_t(size_x + 2 * halo);
+        b_xy = b_x * size_t(size_y + 2 * halo);
+        storage_size = b_xy * size_t(size_z + 2 * halo);
+        data = static_cast<T*>(
+            Memory::allocate(storage_size * sizeof(T), placement, sizeof(T)));
+        std::uninitialized_fill(data, data + storage_size, default_element);
     }
 
-    Array3D(size_t size_x,
-            size_t size_y,
-            size_t size_z,
-            const T& default_element,
-            const T& error_element)
-        : sx(size_x), sy(size_y), sz(size_z), error_element(error_element) {
-        b_x = size_x;
-        b_xy = size_x * size_y;
-        data = std::shared_ptr<T[]>(new T[size_x * size_y * size_z]{default_element});
+    ~Array3D() {
+        if (data == nullptr) return;
+        for (size_t i = 0; i < storage_size; ++i) data[i].~T();
+        Memory::release(data, storage_size * sizeof(T));
     }
 
     Array3D(const Array3D&) = delete;
-    T& at(size_t x, size_t y, size_t z) {
-        if (x < 0 || x >= sx || y < 0 || y >= sy || z < 0 || z >= sz) return error_element;
-        return data[x + y * b_x + z * b_xy];
+    Array3D& operator=(const Array3D&) = delete;
+    Array3D(Array3D&& other) noexcept { *this = std::move(other); }
+    Array3D& operator=(Array3D&& other) noexcept {
+        std::swap(data, other.data);  // the old storage is released by other
+        std::swap(storage_size, other.storage_size);
+        size = other.size;
+        halo = other.halo;
+        b_x = other.b_x;
+        b_xy = other.b_xy;
+        policy = other.policy;
+        error_element = std::move(other.error_element);
+        rejected.store(other.rejected.load());
+        return *this;
     }
-    T& at(const vec3i& i) {
-        if (i.x < 0 || i.x >= sx || i.y < 0 || i.y >= sy || i.z < 0 || i.z >= sz)
-            return error_element;
-        return data[i.x + i.y * b_x + i.z * b_xy];
+
+    bool contains(const vec3i& i) const {
+        return i.x >= 0 && i.x < size.x && i.y >= 0 && i.y < size.y && i.z >= 0 &&
+               i.z < size.z;
     }
-    const T& at(size_t x, size_t y, size_t z) const {
-        if (x < 0 || x >= sx || y < 0 || y >= sy || z < 0 || z >= sz) return error_element;
-        return data[i.x + i.y * b_x + i.z * b_xy];
+    vec3i clamp(const vec3i& i) const { return glm::clamp(i, vec3i(0), size - 1); }
+
+    /**
+     * @brief Whether the box [min, max] reaches outside of the array; counted with the Count
+     * policy. For callers that clamp the coordinates themselves instead of using at.
+     */
+    bool countOutside(const vec3i& min, const vec3i& max) const {
+        if (contains(min) && contains(max)) return false;
+        if (policy == OutOfDomain::Count) rejected.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    T& at(const int x, const int y, const int z) { return at(vec3i(x, y, z)); }
+    const T& at(const int x, const int y, const int z) const { return at(vec3i(x, y, z)); }
+    T& at(const vec3i& i) {
+        if (contains(i)) return unchecked(i);
+        if (policy == OutOfDomain::Clamp) return unchecked(clamp(i));
+        if (policy == OutOfDomain::Count) rejected.fetch_add(1, std::memory_order_relaxed);
+        static thread_local T rejected_element;  // until the thread's next rejected access
+        rejected_element = error_element;
+        return rejected_element;
     }
     const T& at(const vec3i& i) const {
-        if (i.x < 0 || i.x >= sx || i.y < 0 || i.y >= sy || i.z < 0 || i.z >= sz)
-            return error_element;
-        return data[i.x + i.y * b_x + i.z * b_xy];
+        if (contains(i)) return unchecked(i);
+        if (policy == OutOfDomain::Clamp) return unchecked(clamp(i));
+        if (policy == OutOfDomain::Count) rejected.fetch_add(1, std::memory_order_relaxed);
+        return error_element;
     }
 
+    /**
+     * @brief Fast path: the coordinates must be within the array including its halo.
+     */
+    T& unchecked(const vec3i& i) { return data[index(i)]; }
+    const T& unchecked(const vec3i& i) const { return data[index(i)]; }
+
+    /**
+     * @brief Position in the storage; neighbours are at index + offset(direction).
+     */
+    size_t index(const vec3i& i) const {
+        return size_t(i.x + halo) + size_t(i.y + halo) * b_x + size_t(i.z + halo) * b_xy;
+    }
+    ptrdiff_t offset(const vec3i& d) const {
+        return d.x + d.y * ptrdiff_t(b_x) + d.z * ptrdiff_t(b_xy);
+    }
+    size_t storageSize() const { return storage_size; }
+    T& operator[](const size_t index) { return data[index]; }
+    const T& operator[](const size_t index) const { return data[index]; }
+
+    size_t outOfDomainCount() const { return rejected.load(); }
+
    private:
-    std::shared_ptr<T[]> data;
-    size_t b_xy, b_x;
-    size_t sx, sy, sz;
+    T* data = nullptr;
+    vec3i size = vec3i(0);
+    int halo = 0;
+    size_t b_x = 0, b_xy = 0, storage_size = 0;
+    OutOfDomain policy = OutOfDomain::Reject;
     T error_element;
+    mutable std::atomic<size_t> rejected{0};
 };
 
 struct GridCell {
@@ -64,31 +147,164 @@ struct GridCell {
 
 typedef Array3D<GridCell> IDXList3D;
 
+/**
+ * @brief Uniform grid of element indices over an AABB. Positions outside of it belong to the
+ * closest border cell. The cells are padded with one empty halo layer, so the neighbours of
+ * any cell are read without bounds checks.
+ */
 class Grid {
    public:
     Grid() = default;
-    Grid(const vec3i& resolution, const AABB& aabb);
+    Grid(const vec3i& resolution,
+         const AABB& aabb,
+         const Memory::Placement& placement = Memory::Placement());
 
     Grid(const Grid&) = delete;
+    Grid& operator=(const Grid&) = delete;
+    Grid(Grid&&) = default;
+    Grid& operator=(Grid&&) = default;
     vec3i coords(const glm::vec3& pos) const;
     void insert(const glm::vec3& pos, size_t idx);
     void insert(const vec3i& coords, size_t idx);
-    void clear(const vec3i& coords);
+    void clear();  // all cells
     const glm::vec3& cellCenter(const vec3i& coords) const;
+    // coords of a cell (see coords); its neighbours may be in the halo
     void closeUniqueElements(const vec3i& coords,
                              const size_t& self_idx,
                              const int neighbours_idx,
                              std::vector<size_t>& output);
+    void closeElements(const vec3i& coords,
+                       const int neighbours_idx,
+                       std::vector<size_t>& output) const;
+    // all elements of the 27 cells around
+    void neighbourElements(const vec3i& coords, std::vector<size_t>& output) const;
+
+    size_t cellCount() const { return size_t(resolution.x) * resolution.y * resolution.z; }
+
+    /**
+     * @brief Number of cells with elements. They are kept in the order of their first
+     * insertion until sortOccupied.
+     */
+    size_t occupiedCount() const { return occupied.size(); }
+
+    /**
+     * @brief Orders the occupied cells by blocks of BLOCK^3 cells (counting sort; within a
+     * block in insertion order), so consecutive cells and their half shells are close in
+     * memory, and a range of them (see forEachCellPair) covers a compact region.
+     */
+    void sortOccupied();
+    static constexpr int BLOCK = 8;
+
+    /**
+     * @brief Calls func(a, b) for every pair of elements within the occupied cells [begin,
+     * end) and between each of these cells and the 13 neighbours that follow it in memory
+     * order (half shell). Over all occupied cells, every pair of elements in the same or in
+     * adjacent cells is visited exactly once, so disjoint ranges can be processed in parallel.
+     */
+    template <typename Func>
+    void forEachCellPair(const size_t begin, const size_t end, Func func) const;
 
    private:
-    std::vector<glm::vec3> neighbours[8];
-    IDXList3D grid = IDXList3D(0, 0, 0, GridCell());
+    static const vec3i HALF_SHELL[13];
+    ptrdiff_t half_shell[13] = {};   // HALF_SHELL as offsets in the storage of the grid
+    std::vector<size_t> occupied;    // storage indices of the cells
+    // 1 per cell with elements; checked before the cell
+    std::vector<uint8_t, Memory::LargeAllocator<uint8_t>> occupancy;
+    std::vector<vec3i> neighbours[8];
+
+    // block of every occupied cell and the buffers of sortOccupied
+    std::vector<uint32_t> occupied_blocks;
+    std::vector<size_t> block_starts;
+    std::vector<size_t> sorted;
+    std::vector<uint32_t> sorted_blocks;
+    vec3i blocks = vec3i(0);  // per axis
+    IDXList3D grid = IDXList3D(0, 0, 0, GridCell(), 1, OutOfDomain::Clamp);
     AABB aabb;
     glm::vec3 cell_size = glm::vec3(0);
     glm::vec3 cell_radius = glm::vec3(0);
     glm::vec3 size = glm::vec3(1, 1, 1);
     vec3i resolution = vec3i(0, 0, 0);
 };
+
+/**
+ * @brief Particle grids of increasing cell size for particles of different radii. Level l has
+ * cells 2^l times as large as level 0; every particle is stored in the finest level whose
+ * cells are at least cell_radii radii wide. Touching particles of the same level are in
+ * neighbouring cells; a particle finds the larger ones by looking up its position in the
+ * coarser levels. cell_radii >= 4 is needed for the lookup of only the 8 cells of the quadrant
+ * of a position (closeElements); the half shell of Grid::forEachCellPair needs just 2.
+ */
+class HierarchicalGrid {
+   public:
+    HierarchicalGrid() = default;
+    HierarchicalGrid(const AABB& aabb,
+                     const float min_radius,
+                     const float max_radius,
+                     const float cell_radii = 6.f,
+                     const Memory::Placement& placement = Memory::Placement());
+
+    size_t levelCount() const { return levels.size(); }
+    int level(const float radius) const;
+    vec3i coords(const int level, const glm::vec3& pos) const {
+        return levels[level].coords(pos);
+    }
+    void insert(const int level, const vec3i& coords, size_t idx) {
+        levels[level].insert(coords, idx);
+    }
+    void clear() {
+        for (Grid& grid : levels) grid.clear();
+    }
+    void sortOccupied() {
+        for (Grid& grid : levels) grid.sortOccupied();
+    }
+
+    /**
+     * @brief Candidates that may touch the particle self_idx at the given position: the
+     * elements with a larger index of its own level and all elements of the coarser levels
+     * in the (up to) 8 cells around the position. Every pair is reported only once.
+     */
+    void closeElements(const glm::vec3& pos,
+                       const int level,
+                       const vec3i& coords,
+                       const size_t self_idx,
+                       std::vector<size_t>& output);
+
+    /**
+     * @brief Only the candidates of the coarser levels (see closeElements); the pairs within a
+     * level can be found with grid(level).forEachCellPair instead.
+     */
+    void coarserElements(const glm::vec3& pos, const int level, std::vector<size_t>& output);
+    const Grid& grid(const size_t level) const { return levels[level]; }
+
+   private:
+    static constexpr size_t MAX_CELLS_PER_LEVEL = size_t(1) << 20;
+    std::vector<Grid> levels;
+    float min_cell_size = 0.f;
+    float cell_radii = 6.f;
+};
+
+// ------------------------------------------------------------------------------------------------
+
+template <typename Func>
+void Grid::forEachCellPair(const size_t begin, const size_t end, Func func) const {
+    for (size_t cell = begin; cell < end; ++cell) {
+        const size_t index = occupied[cell];
+        const std::vector<size_t>& content = grid[index].content;
+
+        for (size_t i = 0; i < content.size(); ++i) {
+            for (size_t j = i + 1; j < content.size(); ++j) func(content[i], content[j]);
+        }
+        for (const ptrdiff_t offset : half_shell) {
+            const size_t neighbour = index + offset;  // at most in the halo
+            if (!occupancy[neighbour]) continue;
+            const std::vector<size_t>& other = grid[neighbour].content;
+            for (const size_t& a : content) {
+                for (const size_t& b : other) func(a, b);
+            }
+        }
+    }
+}
+
 }  // namespace gathering
 
 #endif
\ No newline at end of file
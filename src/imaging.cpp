@@ -0,0 +1,131 @@
+#include "imaging.hpp"
+
+#include <algorithm>
+
+namespace gathering {
+
+std::vector<ImageView> imageViews(const AABB& vessel_bb, const int slice_count) {
+    // calc camera positions for images
+    glm::vec3 vessel_radius = (vessel_bb.max - vessel_bb.min) / 2.0f;
+    glm::vec3 vessel_center = vessel_bb.min + vessel_radius;
+    std::vector<ImageView> views;
+    views.reserve(3 + slice_count);
+
+    glm::vec3 camera_positions[3] = {vessel_center + glm::vec3(vessel_radius.x, 0, 0),
+                                     vessel_center + glm::vec3(0.1f, vessel_radius.y, 0.1f),
+                                     vessel_center + glm::vec3(0, 0, vessel_radius.z)};
+    glm::vec3 up_vector[3] = {glm::vec3(0, 1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 1, 0)};
+    // half width and height of the projected area
+    glm::vec2 extent[3] = {glm::vec2(vessel_radius.z, vessel_radius.y),
+                           glm::vec2(vessel_radius.x, vessel_radius.z),
+                           glm::vec2(vessel_radius.x, vessel_radius.y)};
+
+    // projections
+    float far_plane = 2.f * vessel_radius.z + 1.f;
+    for (int i = 0; i < 3; ++i) {
+        views.push_back({glm::lookAt(camera_positions[i], vessel_center, up_vector[i]),
+                         glm::ortho(-extent[i].x - 1.0f,
+                                    extent[i].x + 1.0f,
+                                    -extent[i].y - 1.0f,
+                                    extent[i].y + 1.0f,
+                                    -1.f,
+                                    far_plane),
+                         -1.f,
+                         far_plane});
+    }
+
+    // slices
+    float thickness = (vessel_radius.z * 2.f + 0.1f) / slice_count;
+    glm::mat4 slice_view = glm::lookAt(camera_positions[2], vessel_center, up_vector[2]);
+    for (int i = 0; i < slice_count; ++i) {
+        float near_plane = -0.1f + i * thickness;
+        float slice_far_plane = -0.1f + (i + 1) * thickness;
+        views.push_back({slice_view,
+                         glm::ortho(-vessel_radius.x - 1.0f,
+                                    vessel_radius.x + 1.0f,
+                                    -vessel_radius.z - 1.0f,
+                                    vessel_radius.z + 1.0f,
+                                    near_plane,
+                                    slice_far_plane),
+                         near_plane,
+                         slice_far_plane});
+    }
+
+    return views;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void cullParticles(const ParticleVector& particles,
+                   const std::vector<ImageView>& views,
+                   const float radius,
+                   std::vector<uint32_t>& indices,
+                   std::vector<size_t>& offsets) {
+    // groups of consecutive views with the same camera and projected area whose near and far
+    // planes both ascend, so the slices of a particle are found by binary search
+    struct Group {
+        size_t first, last;
+        glm::mat4 view_projection;
+        glm::vec2 radius_clip;  // radius of a particle in clip space
+        std::vector<float> far_planes;
+    };
+    auto sameArea = [](const ImageView& a, const ImageView& b) {
+        return a.view == b.view && a.projection[0][0] == b.projection[0][0] &&
+               a.projection[1][1] == b.projection[1][1] &&
+               a.projection[3][0] == b.projection[3][0] &&
+               a.projection[3][1] == b.projection[3][1] && b.near_plane >= a.near_plane &&
+               b.far_plane >= a.far_plane;
+    };
+
+    std::vector<Group> groups;
+    for (size_t v = 0; v < views.size(); ++v) {
+        if (groups.empty() || !sameArea(views[v - 1], views[v])) {
+            Group group;
+            group.first = v;
+            group.view_projection = views[v].projection * views[v].view;
+            const glm::mat4& vp = group.view_projection;
+            group.radius_clip =
+                radius * glm::vec2(glm::length(glm::vec3(vp[0][0], vp[1][0], vp[2][0])),
+                                   glm::length(glm::vec3(vp[0][1], vp[1][1], vp[2][1])));
+            groups.push_back(group);
+        }
+        groups.back().last = v + 1;
+        groups.back().far_planes.push_back(views[v].far_plane);
+    }
+
+    // calls func(view) for every view the particle is visible in
+    auto forEachView = [&](const glm::vec3& position, auto func) {
+        for (const Group& group : groups) {
+            glm::vec4 clip = group.view_projection * glm::vec4(position, 1.f);
+            if (std::abs(clip.x) > 1.f + group.radius_clip.x) continue;
+            if (std::abs(clip.y) > 1.f + group.radius_clip.y) continue;
+
+            const glm::mat4& view = views[group.first].view;
+            float depth = -(view[0][2] * position.x + view[1][2] * position.y +
+                            view[2][2] * position.z + view[3][2]);
+            auto it = std::lower_bound(
+                group.far_planes.begin(), group.far_planes.end(), depth - radius);
+            size_t first = group.first + (it - group.far_planes.begin());
+            for (size_t v = first; v < group.last; ++v) {
+                if (views[v].near_plane > depth + radius) break;
+                func(v);
+            }
+        }
+    };
+
+    // counting sort: bucket sizes, then fill
+    offsets.assign(views.size() + 1, 0);
+    for (const Particle& p : particles) {
+        forEachView(p.position, [&](const size_t v) { offsets[v + 1]++; });
+    }
+    for (size_t v = 0; v < views.size(); ++v) offsets[v + 1] += offsets[v];
+
+    indices.resize(offsets.back());
+    std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < particles.size(); ++i) {
+        forEachView(particles[i].position,
+                    [&](const size_t v) { indices[fill[v]++] = static_cast<uint32_t>(i); });
+    }
+}
+
+}  // namespace gathering
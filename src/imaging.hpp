@@ -0,0 +1,54 @@
+#ifndef GATHERING_IMAGING_H
+#define GATHERING_IMAGING_H
+
+#include <cstdint>
+#include <vector>
+
+#include "gathering/glm_include.hpp"
+#include "particle.hpp"  // AABB
+
+namespace gathering {
+
+/**
+ * @brief Camera setup for a single image taken by Simulation::take_images.
+ */
+struct ImageView {
+    glm::mat4 view;
+    glm::mat4 projection;  // orthographic
+    float near_plane;      // depth range (eye space) covered by the projection
+    float far_plane;
+};
+
+/**
+ * @brief Where the channels of the images of all views are written to: one pointer per view
+ * for every captured channel; the vectors of the other channels are empty (see ImageChannel).
+ */
+struct ImageOutputs {
+    std::vector<unsigned char*> occupancy;
+    std::vector<float*> depth;
+    std::vector<float*> density;
+    std::vector<uint32_t*> ids;
+};
+
+/**
+ * @brief Computes the views for the three projections (x, y and z axis) of the vessel followed
+ * by slice_count slices along the z axis.
+ */
+std::vector<ImageView> imageViews(const AABB& vessel_bb, const int slice_count);
+
+/**
+ * @brief Sorts the particles into one bucket per view. A particle is put into the bucket of
+ * every view whose volume its sphere intersects. Consecutive views that only differ in their
+ * depth range (slices) are handled together, so the cost barely grows with the slice count.
+ * @param indices Particle indices of all buckets, one bucket after the other.
+ * @param offsets The bucket of view v is indices[offsets[v], offsets[v + 1]).
+ */
+void cullParticles(const ParticleVector& particles,
+                   const std::vector<ImageView>& views,
+                   const float radius,
+                   std::vector<uint32_t>& indices,
+                   std::vector<size_t>& offsets);
+
+}  // namespace gathering
+
+#endif
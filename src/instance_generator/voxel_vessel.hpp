@@ -0,0 +1,153 @@
+#ifndef GATHERING_VOXEL_VESSEL_H
+#define GATHERING_VOXEL_VESSEL_H
+
+#include <array>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace gathering {
+namespace InstanceGenerator {
+
+/**
+ * @brief Solid made of unit cubes. The surface between solid and empty cubes forms the vessel;
+ * particles are spawned inside the solid.
+ */
+struct VoxelVessel {
+    int size_x = 0, size_y = 0, size_z = 0;
+    std::vector<unsigned char> voxels;  // 1 = solid; x major, z minor
+
+    VoxelVessel(const int size_x, const int size_y, const int size_z)
+        : size_x(size_x),
+          size_y(size_y),
+          size_z(size_z),
+          voxels(size_t(size_x) * size_y * size_z, 0) {}
+
+    unsigned char& at(const int x, const int y, const int z) {
+        return voxels[(x * size_y + y) * size_z + z];
+    }
+
+    // everything outside of the grid is empty
+    unsigned char solid(const int x, const int y, const int z) const {
+        if (x < 0 || y < 0 || z < 0 || x >= size_x || y >= size_y || z >= size_z) return 0;
+        return voxels[(x * size_y + y) * size_z + z];
+    }
+};
+
+// ------------------------------------------------------------------------------------------------
+
+/**
+ * @brief The cross of resources/instances/cube_cross.obj (5x5x5 cubes).
+ */
+inline VoxelVessel cubeCross() {
+    const int object[5][5][5] = {
+        {{0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {1, 1, 1, 1, 1}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {1, 0, 1, 0, 1}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}},
+        {{1, 1, 1, 1, 1}, {1, 0, 1, 0, 1}, {1, 1, 1, 1, 1}, {1, 0, 1, 0, 1}, {1, 1, 1, 1, 1}},
+        {{0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {1, 0, 1, 0, 1}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}},
+        {{0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}, {1, 1, 1, 1, 1}, {0, 0, 0, 0, 0}, {0, 0, 0, 0, 0}}};
+
+    VoxelVessel vessel(5, 5, 5);
+    for (int x = 0; x < 5; ++x) {
+        for (int y = 0; y < 5; ++y) {
+            for (int z = 0; z < 5; ++z) vessel.at(x, y, z) = object[x][y][z];
+        }
+    }
+    return vessel;
+}
+
+/**
+ * @brief Solid box of the given number of cubes per axis.
+ */
+inline VoxelVessel box(const int size_x, const int size_y, const int size_z) {
+    VoxelVessel vessel(size_x, size_y, size_z);
+    vessel.voxels.assign(vessel.voxels.size(), 1);
+    return vessel;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Writes the surface of the vessel as wavefront obj: two triangles for every face
+ * between a solid and an empty cube; the normals point outwards. Vertices are shared.
+ */
+inline void writeObj(const VoxelVessel& vessel, std::ostream& out) {
+    using std::to_string;
+    const std::vector<std::array<int, 3>> normals = {
+        {-1, 0, 0},  // x, back
+        {1, 0, 0},   // x, forward
+        {0, -1, 0},  // y, back
+        {0, 1, 0},   // y, forward
+        {0, 0, -1},  // z, back
+        {0, 0, 1}    // z, forward
+    };
+
+    // obj index of every corner (0 = not added yet); corners are shifted by one like the cubes
+    const int corners_y = vessel.size_y + 2, corners_z = vessel.size_z + 2;
+    std::vector<size_t> corner_index((vessel.size_x + 2) * corners_y * corners_z, 0);
+    std::vector<std::string> vertices;
+    std::vector<std::string> faces;
+
+    auto corner = [&](const std::array<int, 3>& c) {
+        size_t& index = corner_index[(c[0] * corners_y + c[1]) * corners_z + c[2]];
+        if (index == 0) {
+            vertices.push_back("v " + to_string(c[0]) + " " + to_string(c[1]) + " " +
+                               to_string(c[2]));
+            index = vertices.size();
+        }
+        return to_string(index);
+    };
+
+    for (int x = 0; x < vessel.size_x; ++x) {
+        for (int y = 0; y < vessel.size_y; ++y) {
+            for (int z = 0; z < vessel.size_z; ++z) {
+                if (vessel.solid(x, y, z) == 0) continue;  // outside of object
+
+                // check if neighbouring cells are in- or outside
+                for (int direction = 0; direction < 6; ++direction) {
+                    int dim_prime = direction / 2;  // check in direction 1=x, 2=y or 3=z
+                    int dim_left = (dim_prime - 1 + 3) % 3;
+                    int dim_right = (dim_prime + 1) % 3;
+                    int forward = direction % 2;  // go +1 or -1 in primary dimension
+
+                    // offset to [x, y, z] to find neighbouring cells
+                    std::array<int, 3> d = {0, 0, 0};
+                    d[dim_prime] = forward * 2 - 1;  // map from {0,1} to {-1, 1}
+
+                    // neighbouring cell is inside the object -> don't add a wall
+                    if (vessel.solid(x + d[0], y + d[1], z + d[2]) == 1) continue;
+
+                    // corners of the face
+                    const std::array<int, 3> cube = {x + 1, y + 1, z + 1};
+                    std::array<int, 3> c = cube;
+                    c[dim_prime] += forward;
+                    std::string zero = corner(c);
+                    c[dim_left] += 1;
+                    std::string left = corner(c);
+                    c[dim_right] += 1;
+                    std::string both = corner(c);
+                    c[dim_left] -= 1;
+                    std::string right = corner(c);
+
+                    std::string normal = "//" + to_string(direction + 1);
+                    faces.push_back("f " + zero + normal + " " + left + normal + " " + both +
+                                    normal);
+                    faces.push_back("f " + zero + normal + " " + both + normal + " " + right +
+                                    normal);
+                }
+            }
+        }
+    }
+
+    for (const auto& s : vertices) out << s << "\n";
+    for (const auto& s : normals) {
+        out << "vn " << to_string(s[0]) << " " << to_string(s[1]) << " " << to_string(s[2])
+            << "\n";
+    }
+    for (const auto& s : faces) out << s << "\n";
+}
+
+}  // namespace InstanceGenerator
+}  // namespace gathering
+
+#endif
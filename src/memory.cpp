@@ -0,0 +1,123 @@
+#include "memory.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+#include "meta.hpp"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace gathering {
+namespace Memory {
+
+#ifdef __linux__
+namespace {
+
+size_t mappedSize(const size_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+// a mapping of the size that starts at a huge page boundary; nullptr on failure
+void* mapAligned(const size_t size) {
+    void* ptr = mmap(nullptr,
+                     size + HUGE_PAGE_SIZE,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+    if (ptr == MAP_FAILED) return nullptr;
+
+    uintptr_t begin = reinterpret_cast<uintptr_t>(ptr);
+    uintptr_t aligned = (begin + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (aligned > begin) munmap(ptr, aligned - begin);
+    size_t tail = begin + HUGE_PAGE_SIZE - aligned;  // behind the aligned block
+    if (tail > 0) munmap(reinterpret_cast<void*>(aligned + size), tail);
+    return reinterpret_cast<void*>(aligned);
+}
+
+// every page is written by the thread whose range of elements contains its first byte
+void touchPages(void* ptr, const size_t bytes, const size_t element_size, WorkerPool& pool) {
+    const size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+    unsigned char* data = static_cast<unsigned char*>(ptr);
+    pool.parallelFor(bytes / element_size, [&](size_t begin, size_t end, unsigned int) {
+        size_t first = (begin * element_size + page_size - 1) / page_size * page_size;
+        for (size_t offset = first; offset < end * element_size; offset += page_size) {
+            data[offset] = 0;
+        }
+    });
+}
+
+}  // namespace
+#endif
+
+// ------------------------------------------------------------------------------------------------
+
+void* allocate(const size_t bytes, const Placement& placement, const size_t element_size) {
+#ifdef __linux__
+    if (bytes >= LARGE_ALLOCATION) {
+        const size_t size = mappedSize(bytes);
+        void* ptr = nullptr;
+        if (placement.pages == HugePages::Explicit) {
+            // needs reserved huge pages (vm.nr_hugepages); else transparent ones are used
+            ptr = mmap(nullptr,
+                       size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                       -1,
+                       0);
+            if (ptr == MAP_FAILED) ptr = nullptr;
+        }
+        if (ptr == nullptr) {
+            ptr = mapAligned(size);
+            if (ptr == nullptr) throw std::bad_alloc();
+            if (placement.pages != HugePages::Off) madvise(ptr, size, MADV_HUGEPAGE);
+        }
+        if (placement.first_touch != nullptr) {
+            touchPages(ptr, bytes, element_size, *placement.first_touch);
+        }
+        return ptr;
+    }
+#endif
+    return ::operator new(bytes);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void release(void* ptr, const size_t bytes) {
+    if (ptr == nullptr) return;
+#ifdef __linux__
+    if (bytes >= LARGE_ALLOCATION) {
+        munmap(ptr, mappedSize(bytes));
+        return;
+    }
+#endif
+    ::operator delete(ptr);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void* Arena::allocate(const size_t bytes, const size_t alignment) {
+    while (chunk < chunks.size()) {
+        Chunk& current = chunks[chunk];
+        uintptr_t begin = reinterpret_cast<uintptr_t>(current.data.get()) + used;
+        size_t padding = (alignment - begin % alignment) % alignment;
+        if (used + padding + bytes <= current.size) {
+            used += padding + bytes;
+            return reinterpret_cast<void*>(begin + padding);
+        }
+        ++chunk;  // the rest of this chunk stays unused until reset
+        used = 0;
+    }
+
+    size_t size = std::max(chunk_bytes, bytes + alignment);
+    chunks.push_back({std::make_unique<unsigned char[]>(size), size});
+    chunk = chunks.size() - 1;
+    return allocate(bytes, alignment);
+}
+
+}  // namespace Memory
+}  // namespace gathering
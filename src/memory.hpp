@@ -0,0 +1,141 @@
+#ifndef GATHERING_MEMORY_H
+#define GATHERING_MEMORY_H
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "gathering/simulation.hpp"  // HugePages
+
+namespace gathering {
+
+class WorkerPool;
+
+/**
+ * @brief Allocation of the large arrays of a simulation (particles, grid cells). Blocks of at
+ * least LARGE_ALLOCATION bytes are mapped directly (Linux), aligned to huge pages and backed
+ * by them as requested. Smaller blocks and other platforms use operator new.
+ */
+namespace Memory {
+
+constexpr size_t HUGE_PAGE_SIZE = size_t(1) << 21;  // 2 MiB
+constexpr size_t LARGE_ALLOCATION = HUGE_PAGE_SIZE;
+
+/**
+ * @brief first_touch: if set, the pages of large blocks are first written by the threads of
+ * the pool, split by elements like WorkerPool::parallelFor over the element count. Linux puts
+ * a page on the NUMA node of the thread that writes it first, so the element i of a block
+ * ends up local to the thread that processes it in loops over the same count.
+ */
+struct Placement {
+    HugePages pages = HugePages::Off;
+    WorkerPool* first_touch = nullptr;
+};
+
+/**
+ * @brief Throws std::bad_alloc if the memory can't be allocated. The memory of large blocks
+ * is zeroed.
+ */
+void* allocate(const size_t bytes,
+               const Placement& placement,
+               const size_t element_size = 1);
+void release(void* ptr, const size_t bytes);
+
+/**
+ * @brief STL allocator on top of allocate/release, e.g. for the particles.
+ */
+template <typename T>
+struct LargeAllocator {
+    typedef T value_type;
+    typedef std::true_type is_always_equal;  // release doesn't depend on the placement
+
+    Placement placement;
+
+    LargeAllocator() = default;
+    explicit LargeAllocator(const Placement& placement) : placement(placement) {}
+    template <typename U>
+    LargeAllocator(const LargeAllocator<U>& other) : placement(other.placement) {}
+
+    T* allocate(const size_t n) {
+        return static_cast<T*>(Memory::allocate(n * sizeof(T), placement, sizeof(T)));
+    }
+    void deallocate(T* ptr, const size_t n) { Memory::release(ptr, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const LargeAllocator<U>&) const {
+        return true;
+    }
+    template <typename U>
+    bool operator!=(const LargeAllocator<U>&) const {
+        return false;
+    }
+};
+
+// ------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Bump allocator for scratch memory that only lives for a step. Nothing is freed
+ * before reset, which makes all allocations available again but keeps the chunks, so a
+ * simulation stops allocating after its first steps. Not thread safe.
+ */
+class Arena {
+   public:
+    explicit Arena(const size_t chunk_bytes = size_t(1) << 16) : chunk_bytes(chunk_bytes) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&&) = default;
+    Arena& operator=(Arena&&) = default;
+
+    void* allocate(const size_t bytes, const size_t alignment);
+    void reset() {
+        chunk = 0;
+        used = 0;
+    }
+
+   private:
+    struct Chunk {
+        std::unique_ptr<unsigned char[]> data;
+        size_t size;
+    };
+    std::vector<Chunk> chunks;
+    size_t chunk = 0;  // current one
+    size_t used = 0;   // bytes of the current chunk
+    size_t chunk_bytes;
+};
+
+template <typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    Arena* arena;
+
+    explicit ArenaAllocator(Arena& arena) : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(const size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, const size_t) {}  // until Arena::reset
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return arena == other.arena;
+    }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const {
+        return arena != other.arena;
+    }
+};
+
+/**
+ * @brief Vector in an arena; must not be used after the arena was reset.
+ */
+template <typename T>
+using ScratchVector = std::vector<T, ArenaAllocator<T>>;
+
+}  // namespace Memory
+}  // namespace gathering
+
+#endif
@@ -1,7 +1,22 @@
 #ifndef GATHERING_META_H
 #define GATHERING_META_H
 
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "trace.hpp"
 
 namespace gathering {
 
@@ -32,6 +47,233 @@ class StopWatch {
     std::chrono::high_resolution_clock::time_point t_start;
     std::chrono::high_resolution_clock::time_point t_end;
 };
+
+/**
+ * @brief Measures consecutive phases: lap adds the time since the previous lap (or the
+ * construction) to the given total in microseconds and, while tracing, records the phase
+ * under the given name.
+ */
+class PhaseTimer {
+   public:
+    PhaseTimer() { t_last = Trace::Clock::now(); }
+
+    void lap(double& total_us, const char* trace_name = nullptr) {
+        auto now = Trace::Clock::now();
+        total_us += std::chrono::duration<double, std::micro>(now - t_last).count();
+        if (trace_name != nullptr && Trace::enabled()) {
+            Trace::complete(trace_name, t_last, now);
+        }
+        t_last = now;
+    }
+
+   private:
+    Trace::Clock::time_point t_last;
+};
+
+/**
+ * @brief Decides when to render while simulating: every n-th step only and, if a budget is
+ * given, only as long as rendering took at most budget_ms per second of wall time so far.
+ */
+class RenderPacer {
+   public:
+    RenderPacer(const unsigned int interval_steps, const float budget_ms)
+        : interval(std::max(1u, interval_steps)), budget(budget_ms / 1000.0) {}
+
+    bool stepDue(const size_t step) const { return step % interval == 0; }
+
+    bool budgetAllows() const {
+        if (budget <= 0.0) return true;
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::high_resolution_clock::now() - t_start);
+        return spent_us <= budget * static_cast<double>(elapsed.count());
+    }
+
+    bool due(const size_t step) const { return stepDue(step) && budgetAllows(); }
+
+    void rendered(const long long duration_us) { spent_us += double(duration_us); }
+
+   private:
+    size_t interval;
+    double budget;  // fraction of the wall time
+    double spent_us = 0.0;
+    std::chrono::high_resolution_clock::time_point t_start =
+        std::chrono::high_resolution_clock::now();
+};
+
+/**
+ * @brief Number of threads to use if 0 (= automatic) is requested.
+ */
+inline unsigned int threadCount(const unsigned int requested) {
+    if (requested != 0) return requested;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * @brief Keeps the first exception thrown by any of the threads of a parallel loop, so it can
+ * be rethrown on the calling thread after all of them finished.
+ */
+class FirstException {
+   public:
+    template <typename Func>
+    void run(Func&& func) {
+        try {
+            func();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) error = std::current_exception();
+        }
+    }
+
+    void rethrow() {
+        if (error) std::rethrow_exception(std::exchange(error, nullptr));
+    }
+
+   private:
+    std::mutex mutex;
+    std::exception_ptr error;
+};
+
+/**
+ * @brief Splits [0, count) into contiguous ranges and calls func(begin, end, thread_idx) for
+ * every range on its own thread. The calling thread processes the first range. If func
+ * throws, all ranges are still finished and the first exception is rethrown.
+ */
+template <typename Func>
+void parallelFor(const size_t count, const unsigned int thread_count, Func func) {
+    size_t threads = std::min<size_t>(std::max(1u, thread_count), std::max<size_t>(1, count));
+    size_t chunk = (count + threads - 1) / threads;
+    FirstException exception;
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t t = 1; t < threads; ++t) {
+        size_t begin = std::min(count, t * chunk);
+        size_t end = std::min(count, begin + chunk);
+        workers.emplace_back([&func, &exception, begin, end, t]() {
+            exception.run([&]() { func(begin, end, static_cast<unsigned int>(t)); });
+        });
+    }
+    exception.run([&]() { func(size_t(0), std::min(count, chunk), 0u); });
+    for (auto& worker : workers) worker.join();
+    exception.rethrow();
+}
+
+/**
+ * @brief Threads that are kept for repeated parallel loops, so a loop doesn't create and
+ * join threads. parallelFor splits like the free function and the calling thread again
+ * processes the first range; range t always goes to the same thread. One loop at a time. If
+ * func throws, parallelFor waits for all ranges and rethrows the first exception.
+ * pin: the worker of range t only runs on the t-th allowed CPU (Linux), so memory it touched
+ * first stays on its NUMA node. The calling thread isn't pinned.
+ */
+class WorkerPool {
+   public:
+    explicit WorkerPool(const unsigned int thread_count, const bool pin = false)
+        : thread_count(std::max(1u, thread_count)), pin(pin) {
+        for (unsigned int t = 1; t < this->thread_count; ++t) {
+            workers.emplace_back([this, t]() { work(t); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        start.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    unsigned int size() const { return thread_count; }  // including the calling thread
+
+    template <typename Func>
+    void parallelFor(const size_t count, Func func) {
+        const size_t threads = std::min<size_t>(thread_count, std::max<size_t>(1, count));
+        const size_t chunk = (count + threads - 1) / threads;
+        if (threads == 1) {
+            func(size_t(0), count, 0u);
+            return;
+        }
+
+        // the workers reference func and the exception until all of them are done
+        FirstException exception;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = [&func, &exception](size_t begin, size_t end, unsigned int t) {
+                exception.run([&]() { func(begin, end, t); });
+            };
+            task_count = count;
+            task_chunk = chunk;
+            task_threads = threads;
+            pending = threads - 1;
+            ++generation;
+        }
+        start.notify_all();
+        exception.run([&]() { func(size_t(0), std::min(count, chunk), 0u); });
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]() { return pending == 0; });
+            task = nullptr;
+        }
+        exception.rethrow();
+    }
+
+   private:
+    static void pinToCpu(const unsigned int t) {
+#ifdef __linux__
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+        int index = int(t % unsigned(CPU_COUNT(&allowed)));
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &allowed) || index-- > 0) continue;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+#else
+        (void)t;
+#endif
+    }
+
+    void work(const unsigned int t) {
+        if (pin) pinToCpu(t);  // before the first loop
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            start.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            if (t >= task_threads) continue;
+
+            const size_t begin = std::min(task_count, t * task_chunk);
+            const size_t end = std::min(task_count, begin + task_chunk);
+            lock.unlock();
+            task(begin, end, t);
+            lock.lock();
+            if (--pending == 0) done.notify_one();
+        }
+    }
+
+    unsigned int thread_count;
+    bool pin;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+    std::function<void(size_t, size_t, unsigned int)> task;
+    size_t task_count = 0;
+    size_t task_chunk = 0;
+    size_t task_threads = 0;
+    size_t pending = 0;  // workers that haven't finished the current loop
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+
 }  // namespace gathering
 
 #endif
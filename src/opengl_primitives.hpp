@@ -34,6 +34,86 @@ struct GLBuffer {
 
 // ------------------------------------------------------------------------------------------------
 
+/**
+ * @brief Persistently mapped buffer (glBufferStorage) that is split into equally sized regions
+ * which are written round robin. Every region is protected by a fence, so a region is only
+ * written again after the gpu has finished all commands that were issued while it was in use.
+ * The memory is mapped coherently, no explicit flush is needed.
+ */
+struct GLRingBuffer {
+    GLuint buffer_idx = 0u;  // opengl index of this buffer
+    size_t region_count;     // number of regions in the ring
+    size_t region_size = 0;  // size of a region in bytes
+    size_t alignment = 1;    // alignment of the regions in bytes
+    size_t current = 0;      // region that is written/used right now
+    unsigned char* mapped = nullptr;
+    std::vector<GLsync> fences;
+
+    GLRingBuffer(const size_t region_count = 3) : region_count(region_count) {}
+    ~GLRingBuffer() { release(); }
+    GLRingBuffer(const GLRingBuffer&) = delete;
+    GLRingBuffer& operator=(const GLRingBuffer&) = delete;
+
+    size_t offset() const { return current * region_size; }  // of the current region in bytes
+
+    /**
+     * @brief Moves on to the next region and returns a pointer to it. Blocks until the gpu
+     * is done with this region. The storage is (re)allocated if a region is smaller than the
+     * requested size.
+     */
+    unsigned char* next(const size_t bytes) {
+        if (bytes > region_size) {
+            allocate(bytes + bytes / 2);  // some headroom to avoid frequent reallocations
+            return mapped;
+        }
+
+        fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        current = (current + 1) % region_count;
+        if (fences[current] != nullptr) {
+            GLenum state = GL_TIMEOUT_EXPIRED;
+            while (state == GL_TIMEOUT_EXPIRED) {
+                state = glClientWaitSync(
+                    fences[current], GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+            }
+            glDeleteSync(fences[current]);
+            fences[current] = nullptr;
+        }
+        return mapped + offset();
+    }
+
+    void allocate(const size_t bytes) {
+        release();
+        region_size = (bytes + alignment - 1) / alignment * alignment;
+        fences.assign(region_count, nullptr);
+        current = 0;
+
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &buffer_idx);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer_idx);
+        glBufferStorage(GL_COPY_WRITE_BUFFER, region_size * region_count, 0, flags);
+        mapped = static_cast<unsigned char*>(
+            glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, region_size * region_count, flags));
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    /**
+     * @brief Deletes the buffer. Must be called while the gl context is still alive.
+     */
+    void release() {
+        if (buffer_idx == 0u) return;
+        for (GLsync fence : fences) {
+            if (fence != nullptr) glDeleteSync(fence);
+        }
+        fences.clear();
+        glDeleteBuffers(1, &buffer_idx);  // unmaps the buffer
+        buffer_idx = 0u;
+        region_size = 0;
+        mapped = nullptr;
+    }
+};
+
+// ------------------------------------------------------------------------------------------------
+
 /**
  * @brief Store all the data to describe a vertex. Must not contain additional data.
  */
@@ -86,5 +86,26 @@ GLuint createProgram(const GLuint vertex_shader, const GLuint fragment_shader) {
     return program;
 }
 
+// ------------------------------------------------------------------------------------------------
+
+GLuint createProgram(const GLuint vertex_shader,
+                     const GLuint geometry_shader,
+                     const GLuint fragment_shader) {
+    GLuint program = glCreateProgram();
+    GLint link_ok = GL_FALSE;
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, geometry_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+    glGetProgramiv(program, GL_LINK_STATUS, &link_ok);
+    if (!link_ok) {
+        printf("Error in glLinkProgram\n");
+        assert(false);
+        exit(EXIT_FAILURE);
+    }
+
+    return program;
+}
+
 }  // namespace tools
 }  // namespace gathering
@@ -31,6 +31,14 @@ GLuint createShader(const std::string& file_name, GLenum shader_type);
  */
 GLuint createProgram(const GLuint vertex_shader, const GLuint fragment_shader);
 
+/**
+ * @brief Link a vertex, geometry and fragment shader to an opengl program.
+ * @return Linked opengl program.
+ */
+GLuint createProgram(const GLuint vertex_shader,
+                     const GLuint geometry_shader,
+                     const GLuint fragment_shader);
+
 /**
  * @brief Outputs debug information about opengl objects.
  */
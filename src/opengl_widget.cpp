@@ -1,7 +1,10 @@
 #include "opengl_widget.hpp"
 
 #include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 
 #include "gathering/glm_include.hpp"
 #include "imgui.h"
@@ -9,10 +12,10 @@
 #include "imgui_impl_opengl3.h"
 #include "opengl_toolkit.hpp"
 #include "particle.hpp"
+#include "trace.hpp"
 
 namespace gathering {
 
-using OpenGLPrimitives::GLBuffer;
 using OpenGLPrimitives::ObjectInfo;
 using OpenGLPrimitives::VertexData;
 using namespace tools;
@@ -40,7 +43,10 @@ void OpenGLWidget::init() {
 
     // Create window with graphics context
     window = glfwCreateWindow(1280, 720, "Gathering", NULL, NULL);
-    if (window == NULL) return;
+    if (window == NULL) {
+        fprintf(stderr, "Failed to create glfw window!\n");
+        return;
+    }
     glfwMakeContextCurrent(window);
     glfwSwapInterval(0);  // vsync
     initEventHandler();   // glfw events like mouse/keyboard/window inputs
@@ -68,6 +74,7 @@ void OpenGLWidget::init() {
     glEnable(GL_PRIMITIVE_RESTART);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glEnable(GL_PROGRAM_POINT_SIZE);  // impostors
     glLineWidth(1.5f);
     glPrimitiveRestartIndex(MAX_ELEMENT_ID);
 
@@ -83,24 +90,64 @@ void OpenGLWidget::init() {
     mvp_prog = createProgram(vertex_shader, frag_shader);
     mvp_prog_non_shaded = createProgram(vertex_shader, frag_non_shaded);
     static_prog = createProgram(vertex_static_shader, frag_shader);
+    GLuint vertex_layered = createShader("shader/layered.vert", GL_VERTEX_SHADER);
+    GLuint geometry_layered = createShader("shader/layered.geom", GL_GEOMETRY_SHADER);
+    GLuint frag_layered = createShader("shader/layered.frag", GL_FRAGMENT_SHADER);
+    layered_prog = createProgram(vertex_layered, geometry_layered, frag_layered);
+    layer_count_location = glGetUniformLocation(layered_prog, "layer_count");
+
+    // sphere impostors
+    GLuint vertex_impostor = createShader("shader/impostor.vert", GL_VERTEX_SHADER);
+    GLuint frag_impostor = createShader("shader/impostor.frag", GL_FRAGMENT_SHADER);
+    impostor_prog = createProgram(vertex_impostor, frag_impostor);
+    impostor_shaded_location = glGetUniformLocation(impostor_prog, "shaded");
+    GLfloat point_sizes[2] = {1.f, 1.f};
+    glGetFloatv(GL_POINT_SIZE_RANGE, point_sizes);
+    max_point_size = point_sizes[1];
+    GLuint geometry_layered_impostor =
+        createShader("shader/layered_impostor.geom", GL_GEOMETRY_SHADER);
+    GLuint frag_layered_impostor =
+        createShader("shader/layered_impostor.frag", GL_FRAGMENT_SHADER);
+    layered_impostor_prog =
+        createProgram(vertex_layered, geometry_layered_impostor, frag_layered_impostor);
+    layered_impostor_count_location =
+        glGetUniformLocation(layered_impostor_prog, "layer_count");
+    layered_impostor_viewport_location =
+        glGetUniformLocation(layered_impostor_prog, "viewport");
+    for (GLuint prog : {mvp_prog_non_shaded, impostor_prog, layered_impostor_prog}) {
+        glUseProgram(prog);
+        glUniform1f(glGetUniformLocation(prog, "radius"), float(RADIUS_PARTICLE));
+    }
+    glUseProgram(0);
 
-    // bind uniform vbo to programs
-    glGenBuffers(1, &vbo_uniforms);
+    // bind uniform block to programs; the buffer range is bound in pushUniforms
+    GLint uniform_alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_alignment);
+    ring_uniforms.alignment = static_cast<size_t>(uniform_alignment);
     GLuint index = glGetUniformBlockIndex(mvp_prog, "Global");
-    glBindBufferBase(GL_UNIFORM_BUFFER, 1, vbo_uniforms);
     glUniformBlockBinding(mvp_prog, index, 1);
     index = glGetUniformBlockIndex(mvp_prog_non_shaded, "Global");
-    glBindBufferBase(GL_UNIFORM_BUFFER, 1, vbo_uniforms);
     glUniformBlockBinding(mvp_prog_non_shaded, index, 1);
     index = glGetUniformBlockIndex(static_prog, "Global");
-    glBindBufferBase(GL_UNIFORM_BUFFER, 1, vbo_uniforms);
     glUniformBlockBinding(static_prog, index, 1);
+    index = glGetUniformBlockIndex(impostor_prog, "Global");
+    glUniformBlockBinding(impostor_prog, index, 1);
+
+    // bind uniform vbo for the layers to the layered program
+    glGenBuffers(1, &vbo_layers);
+    glBindBuffer(GL_UNIFORM_BUFFER, vbo_layers);
+    glBufferData(
+        GL_UNIFORM_BUFFER, sizeof(LayerInfo) * MAX_LAYERS_PER_PASS, 0, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    index = glGetUniformBlockIndex(layered_prog, "Layers");
+    glBindBufferBase(GL_UNIFORM_BUFFER, 2, vbo_layers);
+    glUniformBlockBinding(layered_prog, index, 2);
+    index = glGetUniformBlockIndex(layered_impostor_prog, "Layers");
+    glUniformBlockBinding(layered_impostor_prog, index, 2);
 
     // create storage buffer
     glGenBuffers(1, &vbo_static);
     glGenBuffers(1, &ibo_static);
-    buffer_transformations = GLBuffer<glm::mat4>(GL_DYNAMIC_DRAW);
-    buffer_transformations.gen();
 
     // create vao
     glGenVertexArrays(1, &vao);
@@ -118,26 +165,11 @@ void OpenGLWidget::init() {
     glEnableVertexAttribArray(3);  // normals
     glVertexAttribPointer(
         3, 3, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)(sizeof(GL_FLOAT) * 9));
-    glBindBuffer(GL_ARRAY_BUFFER,
-                 buffer_transformations.buffer_idx);  // object transformations
+    // particle position + scalar; the buffer is bound in updateInstances
     glEnableVertexAttribArray(4);
-    glEnableVertexAttribArray(5);
-    glEnableVertexAttribArray(6);
-    glEnableVertexAttribArray(7);
-    // maximum size for vertexAttr is 4. So we split the 4x4matrix into 4x vec4
-    glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 16, (void*)(0));
-    glVertexAttribPointer(
-        5, 4, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 16, (void*)(sizeof(float) * 4));
-    glVertexAttribPointer(
-        6, 4, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 16, (void*)(sizeof(float) * 8));
-    glVertexAttribPointer(
-        7, 4, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 16, (void*)(sizeof(float) * 12));
-    glVertexAttribDivisor(
-        4, 1);  // update transformation attr. every 1 instance instead of every vertex
-    glVertexAttribDivisor(5, 1);
-    glVertexAttribDivisor(6, 1);
-    glVertexAttribDivisor(7, 1);
+    glVertexAttribDivisor(4, 1);  // next instance attr. for every instance, not every vertex
     glBindVertexArray(0);
+    is_initialized = true;
 }
 
 // ------------------------------------------------------------------------------------------------
@@ -157,7 +189,12 @@ void OpenGLWidget::setImageMode(bool image_mode) {
 
     ret = object_names.find("particles");
     if (ret != object_names.end()) {
-        objects[ret->second].gl_program = image_mode ? mvp_prog_non_shaded : mvp_prog;
+        objects[ret->second].gl_program = particleProgram();
+    }
+    if (is_initialized) {  // images of impostors are not shaded either
+        glUseProgram(impostor_prog);
+        glUniform1i(impostor_shaded_location, !image_mode);
+        glUseProgram(0);
     }
 
     clear_color = image_mode ? glm::vec3(0) : glm::vec3(0.09f);
@@ -308,6 +345,25 @@ void OpenGLWidget::updateScene(const SceneData& scene) {
     if (!window_visible) return;
 #endif
 
+    updateCamera();
+    updateInstances(scene);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::updateScene(const SceneSnapshot& snapshot) {
+#ifdef GATHERING_AUTO_HEADLESS
+    // do nothing if the glfw window is not visible
+    if (!window_visible) return;
+#endif
+
+    updateCamera();
+    uploadInstances(snapshot.particles.data(), snapshot.particles.size());
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::updateCamera() {
     // camera movement with keyboard
     glm::vec3 camera_movement = glm::vec3(0);
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) camera_movement += glm::vec3(0, 0, -1);
@@ -351,45 +407,773 @@ void OpenGLWidget::updateScene(const SceneData& scene) {
         projection = glm::perspective(45.0f, 1.0f * viewport[2] / viewport[3], 0.01f, 100.0f);
     }
 
-    // push mvp to VBO
-    glBindBuffer(GL_UNIFORM_BUFFER, vbo_uniforms);
-    glBufferData(
-        GL_UNIFORM_BUFFER, 2 * sizeof(glm::mat4) + sizeof(glm::vec3), 0, GL_DYNAMIC_DRAW);
-    glBufferSubData(
-        GL_UNIFORM_BUFFER, 0 * sizeof(glm::mat4), sizeof(glm::mat4), glm::value_ptr(view));
-    glBufferSubData(GL_UNIFORM_BUFFER,
-                    1 * sizeof(glm::mat4),
-                    sizeof(glm::mat4),
-                    glm::value_ptr(projection));
-    glBufferSubData(GL_UNIFORM_BUFFER,
-                    2 * sizeof(glm::mat4),
-                    sizeof(glm::vec3),
-                    glm::value_ptr(camera_position));
-    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    pushUniforms();
+}
 
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::pushUniforms() {
+    // write into the next region of the ring
+    unsigned char* uniforms = ring_uniforms.next(UNIFORM_BLOCK_SIZE);
+    if (uniforms == nullptr) return;
+    writeUniforms(uniforms);
+    glBindBufferRange(GL_UNIFORM_BUFFER,
+                      1,
+                      ring_uniforms.buffer_idx,
+                      ring_uniforms.offset(),
+                      UNIFORM_BLOCK_SIZE);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::writeUniforms(unsigned char* uniforms) const {
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);  // viewport: x, y, width, height
+    const glm::vec4 viewport_f = glm::vec4(viewport[0], viewport[1], viewport[2], viewport[3]);
+    const glm::mat4 inverse_projection = glm::inverse(projection);
+
+    // std140, see uniform block "Global"
+    const size_t mat = sizeof(glm::mat4);
+    memcpy(uniforms + 0 * mat, glm::value_ptr(view), mat);
+    memcpy(uniforms + 1 * mat, glm::value_ptr(projection), mat);
+    memcpy(uniforms + 2 * mat, glm::value_ptr(camera_position), sizeof(glm::vec3));
+    const size_t vec = sizeof(glm::vec4);
+    memcpy(uniforms + 2 * mat + vec, glm::value_ptr(viewport_f), vec);
+    memcpy(uniforms + 2 * mat + 2 * vec, glm::value_ptr(inverse_projection), mat);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::updateInstances(const SceneData& scene) {
+    uploadInstances(scene.particles.data(), scene.particles.size());
+}
+
+// ------------------------------------------------------------------------------------------------
+
+template <typename P>
+void OpenGLWidget::uploadInstances(const P* particles, const size_t count) {
     // #############################
     // # dynamic part of scene
     // #############################
 
-    buffer_transformations.values.clear();
-
+    // nothing is drawn until instances were uploaded (e.g. before the first snapshot)
     auto info_particles = getObjectInfo("particles");
-    if (info_particles != nullptr)
-        info_particles->base_instance = buffer_transformations.size();  // offset
-    for (const auto& particle : scene.particles) {
-        glm::mat4 mat = glm::translate(particle.position);
-        buffer_transformations.values.push_back(mat);
+    if (info_particles != nullptr) {
+        info_particles->base_instance = 0;  // offset
+        info_particles->number_instances = 0;
+    }
+    culled_view_count = 0;
+    if (count == 0) return;
+
+    // write the instances straight into the next region of the persistently mapped ring
+    unsigned char* instances = ring_instances.next(sizeof(glm::vec4) * count);
+    if (instances == nullptr) return;
+    glm::vec2 scalar_range =
+        writeInstances(particles, count, reinterpret_cast<glm::vec4*>(instances));
+    bindInstances();
+    if (info_particles != nullptr) info_particles->number_instances = count;
+
+    // level of detail of the window: the closest particle must not look too coarse
+    if (!particle_lods.empty() && !is_image_mode) {
+        float min_distance_sqr = std::numeric_limits<float>::infinity();
+        for (size_t i = 0; i < count; ++i) {
+            glm::vec3 d = particles[i].position - camera_position;
+            min_distance_sqr = std::min(min_distance_sqr, glm::dot(d, d));
+        }
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);  // viewport: x, y, width, height
+        float pixels = projectedDiameter(
+            projection, viewport[2], viewport[3], std::sqrt(min_distance_sqr));
+        particle_lod = particleLod(pixels, false);
+        useParticleLod(particle_lod);
+    }
+
+    // colors of the particles
+    for (GLuint prog : {mvp_prog, impostor_prog}) {
+        glUseProgram(prog);
+        glUniform1i(glGetUniformLocation(prog, "colorize"),
+                    particle_coloring != ParticleColoring::None);
+        glUniform2f(
+            glGetUniformLocation(prog, "scalar_range"), scalar_range.x, scalar_range.y);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::updateInstances(const SceneData& scene,
+                                   const std::vector<ImageView>& views) {
+    culled_view_count = 0;
+    ObjectInfo* info_particles = getObjectInfo("particles");
+    if (info_particles == nullptr || views.empty()) return;
+    std::vector<ObjectInfo> meshes = particle_lods;  // one set of commands per level of detail
+    if (meshes.empty()) meshes.push_back(*info_particles);
+    auto elementSize = [](const ObjectInfo& mesh) -> GLuint {
+        if (mesh.gl_element_type == GL_UNSIGNED_BYTE) return 1;
+        return mesh.gl_element_type == GL_UNSIGNED_SHORT ? 2 : 4;
+    };
+    for (const ObjectInfo& mesh : meshes) {
+        if (mesh.offset_elements % elementSize(mesh) != 0) {  // not addressable by index
+            updateInstances(scene);
+            return;
+        }
+    }
+
+    // instances of all views, one group after the other
+    cullParticles(scene.particles, views, particle_radius, cull_indices, cull_offsets);
+    const size_t count = std::max<size_t>(cull_indices.size(), 1);
+    auto instances =
+        reinterpret_cast<glm::vec4*>(ring_instances.next(sizeof(glm::vec4) * count));
+    if (instances == nullptr) return;
+    for (size_t i = 0; i < cull_indices.size(); ++i) {
+        instances[i] = glm::vec4(scene.particles[cull_indices[i]].position, 0.f);
+    }
+    bindInstances();
+    info_particles->number_instances = 0;  // only drawn through the commands
+
+    // one draw command per view and level of detail
+    auto commands = reinterpret_cast<DrawElementsIndirectCommand*>(ring_indirect.next(
+        sizeof(DrawElementsIndirectCommand) * views.size() * meshes.size()));
+    if (commands == nullptr) return;
+    for (const ObjectInfo& mesh : meshes) {
+        for (size_t v = 0; v < views.size(); ++v, ++commands) {
+            commands->count = static_cast<GLuint>(mesh.number_elements);
+            commands->instance_count =
+                static_cast<GLuint>(cull_offsets[v + 1] - cull_offsets[v]);
+            commands->first_index =
+                static_cast<GLuint>(mesh.offset_elements / elementSize(mesh));
+            commands->base_vertex = static_cast<GLint>(mesh.base_index);
+            commands->base_instance = static_cast<GLuint>(cull_offsets[v]);
+        }
+    }
+    culled_view_count = views.size();
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::bindInstances() {
+    // point the instance attribute to the region (the buffer changes if it had to grow)
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, ring_instances.buffer_idx);
+    glVertexAttribPointer(
+        4, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4), (void*)(ring_instances.offset()));
+    glBindVertexArray(0);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::drawCulled(const size_t view_idx, const size_t lod) {
+    ObjectInfo* info_particles = getObjectInfo("particles");
+    glUseProgram(info_particles->gl_program);
+    glBindVertexArray(info_particles->gl_vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, ring_indirect.buffer_idx);
+    size_t command = lod * culled_view_count + view_idx;
+    size_t offset = ring_indirect.offset() + command * sizeof(DrawElementsIndirectCommand);
+    glMultiDrawElementsIndirect(
+        info_particles->gl_draw_mode, info_particles->gl_element_type, (void*)(offset), 1, 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+float OpenGLWidget::projectedDiameter(const glm::mat4& projection,
+                                      const int width,
+                                      const int height,
+                                      const float distance) const {
+    float w = projection[2][3] != 0.f ? std::max(distance, 1e-3f) : 1.f;  // perspective?
+    float scale = std::max(projection[0][0] * width, projection[1][1] * height);
+    return particle_radius * scale / w;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+size_t OpenGLWidget::particleLod(const float pixels, const bool triangles_only) const {
+    if (!triangles_only && impostorFits(pixels)) return IMPOSTOR_LOD;
+    const size_t mesh_count = std::min(particle_lods.size(), PARTICLE_LOD_COUNT);
+    size_t level = 0;
+    while (level + 1 < mesh_count && pixels < PARTICLE_LODS[level].min_pixels) {
+        level++;
+    }
+    while (triangles_only && level > 0 && particle_lods[level].gl_draw_mode != GL_TRIANGLES) {
+        level--;
+    }
+    return level;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+bool OpenGLWidget::impostorFits(const float pixels) const {
+    // point size of shader/impostor.vert, which is larger than the one of the layered shader
+    return particle_lods.size() > IMPOSTOR_LOD && 1.25f * pixels + 2.f <= max_point_size;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::useParticleLod(const size_t level) {
+    ObjectInfo* info = getObjectInfo("particles");
+    if (info == nullptr || level >= particle_lods.size()) return;
+    const ObjectInfo& lod = particle_lods[level];
+    info->number_elements = lod.number_elements;
+    info->number_vertices = lod.number_vertices;
+    info->offset_elements = lod.offset_elements;
+    info->offset_vertices = lod.offset_vertices;
+    info->base_index = lod.base_index;
+    info->gl_draw_mode = lod.gl_draw_mode;
+    info->gl_element_type = lod.gl_element_type;
+    active_lod = level;
+    info->gl_program = particleProgram();
+}
+
+// ------------------------------------------------------------------------------------------------
+
+GLuint OpenGLWidget::particleProgram() const {
+    if (active_lod == IMPOSTOR_LOD) return impostor_prog;
+    return is_image_mode ? mvp_prog_non_shaded : mvp_prog;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+template <typename P>
+glm::vec2 OpenGLWidget::writeInstances(const P* particles,
+                                       const size_t count,
+                                       glm::vec4* instances) const {
+    glm::vec2 range = glm::vec2(std::numeric_limits<float>::infinity(),
+                                -std::numeric_limits<float>::infinity());
+
+    switch (particle_coloring) {
+        case ParticleColoring::Mass:
+            for (size_t i = 0; i < count; ++i) {
+                const P& p = particles[i];
+                instances[i] = glm::vec4(p.position, p.mass);
+                range = glm::vec2(std::min(range.x, p.mass), std::max(range.y, p.mass));
+            }
+            break;
+        case ParticleColoring::Speed:
+            for (size_t i = 0; i < count; ++i) {
+                const P& p = particles[i];
+                float speed = glm::length(p.velocity);
+                instances[i] = glm::vec4(p.position, speed);
+                range = glm::vec2(std::min(range.x, speed), std::max(range.y, speed));
+            }
+            break;
+        default:
+            for (size_t i = 0; i < count; ++i) {
+                instances[i] = glm::vec4(particles[i].position, 0.f);
+            }
+            range = glm::vec2(0.f, 1.f);
+            break;
+    }
+
+    return range;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::prepareLayerTarget(const int width,
+                                      const int height,
+                                      const int layer_count) {
+    glm::ivec3 size = glm::ivec3(width, height, layer_count);
+    if (fbo_layers != 0u && size == layers_size) return;
+
+    glDeleteFramebuffers(1, &fbo_layers);
+    glDeleteTextures(1, &texture_layers);
+    glDeleteTextures(1, &depth_layers);
+
+    // color and depth layers
+    glGenTextures(1, &texture_layers);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_layers);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_R8, width, height, layer_count);
+    glGenTextures(1, &depth_layers);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, depth_layers);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT24, width, height, layer_count);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // layered framebuffer
+    glGenFramebuffers(1, &fbo_layers);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_layers);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture_layers, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth_layers, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        printf("Layered framebuffer is not complete!\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    layers_size = size;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::readLayers(const std::vector<unsigned char*>& outputs) {
+    TRACE_SCOPE("read layers");
+    const size_t image_size = static_cast<size_t>(layers_size.x) * layers_size.y;
+    const size_t count = std::min(outputs.size(), static_cast<size_t>(layers_size.z));
+    bool contiguous = count == static_cast<size_t>(layers_size.z);
+    for (size_t i = 1; i < count && contiguous; ++i) {
+        contiguous = outputs[i] == outputs[0] + i * image_size;
+    }
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    if (contiguous) {
+        glBindTexture(GL_TEXTURE_2D_ARRAY, texture_layers);
+        glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, GL_RED, GL_UNSIGNED_BYTE, outputs[0]);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        return;
     }
 
-    // push data to VBO
-    if (buffer_transformations.values.size() != 0) {
-        size_t size_transformation =
-            sizeof(buffer_transformations.values[0]) * buffer_transformations.values.size();
-        glBindBuffer(GL_ARRAY_BUFFER, buffer_transformations.buffer_idx);  // set active
-        glBufferData(GL_ARRAY_BUFFER,
-                     size_transformation,
-                     &buffer_transformations.values[0],
-                     GL_STREAM_DRAW);  // push data
+    for (size_t i = 0; i < count; ++i) {
+        glGetTextureSubImage(texture_layers,
+                             0,
+                             0,
+                             0,
+                             static_cast<GLint>(i),
+                             layers_size.x,
+                             layers_size.y,
+                             1,
+                             GL_RED,
+                             GL_UNSIGNED_BYTE,
+                             static_cast<GLsizei>(image_size),
+                             outputs[i]);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::drawLayers(const std::vector<ImageView>& views,
+                              const int width,
+                              const int height) {
+    TRACE_SCOPE("capture layers");
+    ObjectInfo* info_particles = getObjectInfo("particles");
+    if (info_particles == nullptr || views.empty()) return;
+
+    auto layerInfo = [](const ImageView& view, const size_t layer) {
+        LayerInfo info;
+        info.view_projection = view.projection * view.view;
+        info.depth_axis =
+            -glm::vec4(view.view[0][2], view.view[1][2], view.view[2][2], view.view[3][2]);
+        info.depth_range = glm::vec2(view.near_plane, view.far_plane);
+        info.layer = static_cast<GLint>(layer);
+        info.padding = 0;
+        return info;
+    };
+
+    // group views by camera: single views are packed together, slices (same camera and depth
+    // extent) are interleaved so that no triangle intersects too many layers of one pass
+    std::vector<std::vector<LayerInfo>> passes;
+    std::vector<LayerInfo> singles;
+    size_t first = 0;
+    while (first < views.size()) {
+        float extent = views[first].far_plane - views[first].near_plane;
+        size_t last = first + 1;
+        while (last < views.size() && views[last].view == views[first].view &&
+               std::abs(views[last].far_plane - views[last].near_plane - extent) <
+                   extent * 0.001f) {
+            last++;
+        }
+
+        if (last - first == 1) {
+            singles.push_back(layerInfo(views[first], first));
+            if (singles.size() == MAX_LAYERS_PER_PRIMITIVE) {
+                passes.push_back(singles);
+                singles.clear();
+            }
+        } else {
+            size_t stride = static_cast<size_t>(2.f * particle_radius / (3.f * extent)) + 1;
+            for (size_t offset = 0; offset < stride; ++offset) {
+                std::vector<LayerInfo> pass;
+                for (size_t v = first + offset; v < last; v += stride) {
+                    pass.push_back(layerInfo(views[v], v));
+                    if (pass.size() == MAX_LAYERS_PER_PASS) {
+                        passes.push_back(pass);
+                        pass.clear();
+                    }
+                }
+                if (!pass.empty()) passes.push_back(pass);
+            }
+        }
+        first = last;
+    }
+    if (!singles.empty()) passes.push_back(singles);
+
+    // render
+    const int layer_count = static_cast<int>(views.size());
+    prepareLayerTarget(width, height, layer_count);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo_layers);
+    glViewport(0, 0, width, height);
+    glClearColor(0.f, 0.f, 0.f, 1.f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);  // clears all layers
+
+    // meshes: level of detail by the projected size; the geometry shader needs triangles.
+    // impostors: the geometry shader routes the points, the fragment shader cuts the spheres
+    const float pixels = projectedDiameter(views[0].projection, width, height);
+    const bool impostors = impostorFits(pixels);
+    useParticleLod(impostors ? IMPOSTOR_LOD : particleLod(pixels, true));
+    glUseProgram(impostors ? layered_impostor_prog : layered_prog);
+    if (impostors) {
+        glUniform4f(layered_impostor_viewport_location, 0.f, 0.f, float(width), float(height));
+    }
+    glBindVertexArray(info_particles->gl_vao);
+    for (const auto& pass : passes) {
+        glBindBuffer(GL_UNIFORM_BUFFER, vbo_layers);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LayerInfo) * pass.size(), pass.data());
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glUniform1i(impostors ? layered_impostor_count_location : layer_count_location,
+                    static_cast<GLint>(pass.size()));
+        glDrawElementsInstancedBaseVertexBaseInstance(
+            info_particles->gl_draw_mode,
+            static_cast<GLint>(info_particles->number_elements),
+            info_particles->gl_element_type,
+            (void*)(info_particles->offset_elements),
+            static_cast<GLsizei>(info_particles->number_instances),
+            static_cast<GLint>(info_particles->base_index),
+            static_cast<GLint>(info_particles->base_instance));
+    }
+    glBindVertexArray(0);
+    useParticleLod(particle_lod);
+
+    // back to the window
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    int display_w, display_h;
+    glfwGetFramebufferSize(window, &display_w, &display_h);
+    glViewport(0, 0, display_w, display_h);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+OpenGLWidget::CaptureTarget& OpenGLWidget::captureTarget(const int width,
+                                                         const int height,
+                                                         const int samples,
+                                                         const bool channels) {
+    ++capture_count;
+    for (auto& target : capture_targets) {
+        if (target.width == width && target.height == height &&
+            target.samples == std::max(1, samples) && target.channels == channels) {
+            target.last_use = capture_count;
+            return target;
+        }
+    }
+
+    // replace the least recently used target
+    if (capture_targets.size() == MAX_CAPTURE_TARGETS) {
+        auto oldest = std::min_element(capture_targets.begin(),
+                                       capture_targets.end(),
+                                       [](const CaptureTarget& a, const CaptureTarget& b) {
+                                           return a.last_use < b.last_use;
+                                       });
+        releaseCaptureTarget(*oldest);
+        capture_targets.erase(oldest);
+    }
+
+    CaptureTarget target;
+    target.width = width;
+    target.height = height;
+    target.samples = std::max(1, samples);
+    target.channels = channels;
+    target.last_use = capture_count;
+
+    // a sample count > 0 asks for a multisampled buffer, even if it is 1
+    auto storage = [&](const GLenum format, const int samples) {
+        if (samples > 1) {
+            glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, format, width, height);
+        } else {
+            glRenderbufferStorage(GL_RENDERBUFFER, format, width, height);
+        }
+    };
+
+    // render target (multisampled if samples > 1)
+    glGenRenderbuffers(1, &target.color_render);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.color_render);
+    storage(GL_R8, target.samples);
+    glGenRenderbuffers(1, &target.depth_render);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.depth_render);
+    storage(GL_DEPTH_COMPONENT24, target.samples);
+    glGenFramebuffers(1, &target.fbo_render);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo_render);
+    glFramebufferRenderbuffer(
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color_render);
+    glFramebufferRenderbuffer(
+        GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depth_render);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+    // depth and density channels (float); rendered without multisampling, into the render
+    // target if it isn't multisampled, else into a framebuffer of their own
+    if (channels && status == GL_FRAMEBUFFER_COMPLETE) {
+        glGenRenderbuffers(1, &target.depth_channel);
+        glBindRenderbuffer(GL_RENDERBUFFER, target.depth_channel);
+        storage(GL_R32F, 1);
+        glGenRenderbuffers(1, &target.density_channel);
+        glBindRenderbuffer(GL_RENDERBUFFER, target.density_channel);
+        storage(GL_R32F, 1);
+        if (target.samples > 1) {
+            glGenFramebuffers(1, &target.fbo_channels);
+            glBindFramebuffer(GL_FRAMEBUFFER, target.fbo_channels);
+        }
+        glFramebufferRenderbuffer(
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_RENDERBUFFER, target.depth_channel);
+        glFramebufferRenderbuffer(
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_RENDERBUFFER, target.density_channel);
+        const GLenum buffers[3] = {
+            static_cast<GLenum>(target.samples > 1 ? GL_NONE : GL_COLOR_ATTACHMENT0),
+            GL_COLOR_ATTACHMENT1,
+            GL_COLOR_ATTACHMENT2};
+        glDrawBuffers(3, buffers);
+        status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    }
+
+    // resolve target
+    if (status == GL_FRAMEBUFFER_COMPLETE && target.samples > 1) {
+        glGenRenderbuffers(1, &target.color_resolve);
+        glBindRenderbuffer(GL_RENDERBUFFER, target.color_resolve);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_R8, width, height);
+        glGenFramebuffers(1, &target.fbo_resolve);
+        glBindFramebuffer(GL_FRAMEBUFFER, target.fbo_resolve);
+        glFramebufferRenderbuffer(
+            GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.color_resolve);
+        status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    }
+
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        releaseCaptureTarget(target);
+        char message[128];
+        snprintf(message,
+                 sizeof(message),
+                 "Capture framebuffer (%dx%d, %d samples) is not complete: 0x%x",
+                 width,
+                 height,
+                 target.samples,
+                 status);
+        throw std::runtime_error(message);
+    }
+    capture_targets.push_back(target);
+    return capture_targets.back();
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::releaseCaptureTarget(CaptureTarget& target) {
+    glDeleteFramebuffers(1, &target.fbo_render);
+    glDeleteFramebuffers(1, &target.fbo_channels);
+    glDeleteFramebuffers(1, &target.fbo_resolve);
+    glDeleteRenderbuffers(1, &target.color_render);
+    glDeleteRenderbuffers(1, &target.depth_render);
+    glDeleteRenderbuffers(1, &target.color_resolve);
+    glDeleteRenderbuffers(1, &target.depth_channel);
+    glDeleteRenderbuffers(1, &target.density_channel);
+    target = CaptureTarget();
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::renderViews(const std::vector<ImageView>& views,
+                               const int width,
+                               const int height,
+                               const int samples,
+                               const ImageOutputs& outputs) {
+    TRACE_SCOPE("capture views");
+    // depth and density are blended (min/add) instead of depth tested and must not be
+    // averaged by a multisample resolve: with multisampling they get a pass of their own
+    const bool channels = !outputs.depth.empty() || !outputs.density.empty();
+    const CaptureTarget& target = captureTarget(width, height, samples, channels);
+    const bool channel_pass = target.fbo_channels != 0u;
+    const bool was_image_mode = is_image_mode;
+    const glm::mat4 old_view = view;
+    const glm::mat4 old_projection = projection;
+    setImageMode(true);
+    glViewport(0, 0, width, height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    if (channels) {
+        if (!channel_pass) glDisable(GL_DEPTH_TEST);
+        glBlendEquationi(1, GL_MIN);
+        glBlendEquationi(2, GL_FUNC_ADD);
+        glBlendFunci(2, GL_ONE, GL_ONE);
+    }
+
+    // the near and far plane cut the particles like solid spheres: front faces are clamped
+    // to the planes instead of clipped, the shaders discard what lies outside of the view
+    glEnable(GL_DEPTH_CLAMP);
+    glEnable(GL_CULL_FACE);
+
+    // culled particles are drawn separately, one group per view
+    ObjectInfo* info_particles = getObjectInfo("particles");
+    const bool culled = info_particles != nullptr && culled_view_count == views.size();
+    const bool particles_enabled = culled && info_particles->enabled;
+    if (culled) info_particles->enabled = false;
+
+    // the uniforms of all views in a single region of the ring, so the capture waits for at
+    // most one fence however many views it has
+    const size_t view_count = std::min(views.size(), outputs.occupancy.size());
+    const size_t alignment = ring_uniforms.alignment;
+    const size_t uniform_stride = (UNIFORM_BLOCK_SIZE + alignment - 1) / alignment * alignment;
+    unsigned char* uniforms =
+        ring_uniforms.next(uniform_stride * std::max<size_t>(1, view_count));
+    for (size_t i = 0; i < view_count && uniforms != nullptr; ++i) {
+        view = views[i].view;
+        projection = views[i].projection;
+        writeUniforms(uniforms + i * uniform_stride);
+    }
+
+    const GLfloat far_depth = 1.f, no_density = 0.f;
+    for (size_t i = 0; i < view_count; ++i) {
+        view = views[i].view;
+        projection = views[i].projection;
+        glBindBufferRange(GL_UNIFORM_BUFFER,
+                          1,
+                          ring_uniforms.buffer_idx,
+                          ring_uniforms.offset() + i * uniform_stride,
+                          UNIFORM_BLOCK_SIZE);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, target.fbo_render);
+        glClearColor(clear_color.x, clear_color.y, clear_color.z, 1.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        if (channels && !channel_pass) {
+            glClearBufferfv(GL_COLOR, 1, &far_depth);
+            glClearBufferfv(GL_COLOR, 2, &no_density);
+        }
+        size_t lod = particleLod(projectedDiameter(projection, width, height), false);
+        useParticleLod(lod);
+        renderScene();
+        if (particles_enabled) drawCulled(i, lod);
+
+        // depth and density without multisampling
+        if (channel_pass) {
+            glBindFramebuffer(GL_FRAMEBUFFER, target.fbo_channels);
+            glClearBufferfv(GL_COLOR, 1, &far_depth);
+            glClearBufferfv(GL_COLOR, 2, &no_density);
+            glDisable(GL_DEPTH_TEST);
+            renderScene();
+            if (particles_enabled) drawCulled(i, lod);
+            glEnable(GL_DEPTH_TEST);
+        }
+
+        // resolve multisampling
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo_render);
+        if (target.samples > 1) {
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.fbo_resolve);
+            glBlitFramebuffer(
+                0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo_resolve);
+        }
+
+        // to image (waits for the gpu unless a pixel buffer is bound)
+        TRACE_SCOPE("glReadPixels");
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glReadPixels(0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, outputs.occupancy[i]);
+        if (channel_pass) glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo_channels);
+        if (i < outputs.depth.size()) {
+            glReadBuffer(GL_COLOR_ATTACHMENT1);
+            glReadPixels(0, 0, width, height, GL_RED, GL_FLOAT, outputs.depth[i]);
+        }
+        if (i < outputs.density.size()) {
+            glReadBuffer(GL_COLOR_ATTACHMENT2);
+            glReadPixels(0, 0, width, height, GL_RED, GL_FLOAT, outputs.density[i]);
+        }
+    }
+
+    // back to the window
+    if (channels) {
+        glEnable(GL_DEPTH_TEST);
+        glBlendEquation(GL_FUNC_ADD);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+    glDisable(GL_DEPTH_CLAMP);
+    glDisable(GL_CULL_FACE);
+    if (culled) info_particles->enabled = particles_enabled;
+    useParticleLod(particle_lod);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    setImageMode(was_image_mode);
+    view = old_view;
+    projection = old_projection;
+    int display_w, display_h;
+    glfwGetFramebufferSize(window, &display_w, &display_h);
+    glViewport(0, 0, display_w, display_h);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::beginReadback(const size_t bytes) {
+    if (free_readbacks.empty()) {
+        readbacks.push_back(Readback());
+        glGenBuffers(1, &readbacks.back().pbo);
+        free_readbacks.push_back(readbacks.size() - 1);
+    }
+    active_readback = free_readbacks.back();
+    free_readbacks.pop_back();
+
+    Readback& readback = readbacks[active_readback];
+    readback.size = bytes;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+    if (readback.capacity < bytes) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, 0, GL_STREAM_READ);
+        readback.capacity = bytes;
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::endReadback(ReadbackCallback callback) {
+    if (active_readback == SIZE_MAX) return;
+    Readback& readback = readbacks[active_readback];
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.callback = std::move(callback);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    pending_readbacks.push_back(active_readback);
+    active_readback = SIZE_MAX;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::cancelReadback() {
+    if (active_readback == SIZE_MAX) return;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    free_readbacks.push_back(active_readback);
+    active_readback = SIZE_MAX;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void OpenGLWidget::pollReadbacks(const bool wait) {
+    while (!pending_readbacks.empty()) {
+        Readback& readback = readbacks[pending_readbacks.front()];
+        GLenum state;
+        {
+            TRACE_SCOPE("glClientWaitSync");
+            state = glClientWaitSync(
+                readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? READBACK_TIMEOUT : 0);
+        }
+        if (state == GL_TIMEOUT_EXPIRED) {
+            if (!wait) return;
+            throw std::runtime_error("Image readback did not finish in time");
+        }
+        TRACE_SCOPE("deliver readback");
+
+        glDeleteSync(readback.fence);
+        readback.fence = nullptr;
+        if (state == GL_WAIT_FAILED) {
+            failed_readbacks++;
+        } else {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+            const void* pixels =
+                glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readback.size, GL_MAP_READ_BIT);
+            if (pixels != nullptr) {
+                readback.callback(static_cast<const unsigned char*>(pixels));
+            } else {
+                failed_readbacks++;
+            }
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+
+        readback.callback = nullptr;
+        free_readbacks.push_back(pending_readbacks.front());
+        pending_readbacks.pop_front();
+    }
+
+    if (wait && failed_readbacks > 0) {
+        char message[64];
+        snprintf(message, sizeof(message), "%zu image readbacks failed", failed_readbacks);
+        failed_readbacks = 0;
+        throw std::runtime_error(message);
     }
 }
 
@@ -398,17 +1182,46 @@ void OpenGLWidget::updateScene(const SceneData& scene) {
 void OpenGLWidget::prepareInstance(SceneData& scene) {
     deleteInstance();
     std::vector<OpenGLPrimitives::Object> raw_objects;
+    particle_radius = scene.particle_radius;
+    for (GLuint prog : {mvp_prog_non_shaded, impostor_prog, layered_impostor_prog}) {
+        glUseProgram(prog);
+        glUniform1f(glGetUniformLocation(prog, "radius"), particle_radius);
+    }
+    glUseProgram(0);
 
-    // particles
+    // particles: a sphere mesh
+    active_lod = 0;
     OpenGLPrimitives::Object particles = OpenGLPrimitives::createSphere(
-        float(RADIUS_PARTICLE), glm::vec3(0.f), 5, glm::vec4(1, 1, 1, 1));
+        particle_radius, glm::vec3(0.f), 5, glm::vec4(1, 1, 1, 1));
     particles.name = "particles";
     particles.drawInstanced = true;
     particles.instance_count = scene.particles.size();
     particles.gl_vao = vao;
-    particles.gl_program = mvp_prog;
+    particles.gl_program = particleProgram();
     raw_objects.push_back(particles);
 
+    // coarser levels of the particle mesh and the impostor, a single point that is ray-cast in
+    // the fragment shader; swapped into "particles" by useParticleLod
+    const size_t lod_count = use_impostors ? IMPOSTOR_LOD + 1 : PARTICLE_LOD_COUNT;
+    for (size_t level = 1; level < lod_count; ++level) {
+        OpenGLPrimitives::Object lod;
+        if (level == IMPOSTOR_LOD || PARTICLE_LODS[level].accuracy == 0) {
+            lod.vertices.push_back(VertexData(0.f, 0.f, 0.f));
+            lod.vertices.back().color = glm::vec4(1, 1, 1, 1);
+            lod.elements.push_back(0);
+            lod.gl_draw_mode = GL_POINTS;
+        } else {
+            lod = OpenGLPrimitives::createSphere(particle_radius,
+                                                 glm::vec3(0.f),
+                                                 PARTICLE_LODS[level].accuracy,
+                                                 glm::vec4(1, 1, 1, 1));
+        }
+        lod.name = "particles_lod" + std::to_string(level);
+        lod.gl_vao = vao;
+        lod.gl_program = particleProgram();
+        raw_objects.push_back(lod);
+    }
+
     // vessel
     scene.vessel.gl_draw_mode = GL_TRIANGLES;
     scene.vessel.gl_vao = vao;
@@ -416,13 +1229,13 @@ void OpenGLWidget::prepareInstance(SceneData& scene) {
     scene.vessel.gl_program = static_prog;
     raw_objects.push_back(scene.vessel);
 
-    // sort raw_objects by their VAO/program in order to reduce sate changes
+    // sort objects by their VAO/program in order to reduce sate changes
     pushStaticSceneToGPU(raw_objects);
-    std::sort(raw_objects.begin(), raw_objects.end());
+    std::sort(objects.begin(), objects.end());
 
-    // build map to find raw_objects by name
-    for (int i = 0; i < raw_objects.size(); i++) {
-        const auto& obj = raw_objects[i];
+    // build map to find objects by name
+    for (int i = 0; i < objects.size(); i++) {
+        const auto& obj = objects[i];
         if (obj.name != "") {
             auto res = object_names.insert({obj.name, i});
             if (!res.second) {
@@ -433,6 +1246,16 @@ void OpenGLWidget::prepareInstance(SceneData& scene) {
         }
     }
 
+    // levels of detail are never drawn by themselves
+    particle_lods.clear();
+    particle_lod = 0;
+    particle_lods.push_back(*getObjectInfo("particles"));
+    for (size_t level = 1; level < lod_count; ++level) {
+        ObjectInfo* lod = getObjectInfo("particles_lod" + std::to_string(level));
+        lod->enabled = false;
+        particle_lods.push_back(*lod);
+    }
+
     is_prepared = true;
 }
 
@@ -549,6 +1372,12 @@ void OpenGLWidget::buildGUI() {
                 auto info = getObjectInfo("central_mass");
                 if (info != nullptr) info->enabled = !hide_earth;
             }
+
+            const char* colorings[] = {"None", "Mass", "Speed"};
+            int coloring = static_cast<int>(particle_coloring);
+            if (ImGui::Combo("Particle color", &coloring, colorings, 3)) {
+                particle_coloring = static_cast<ParticleColoring>(coloring);
+            }
         }
 
         ImGui::Text("x = %.3f; y = %.3f; z = %.3f",
@@ -566,6 +1395,12 @@ void OpenGLWidget::buildGUI() {
 // ------------------------------------------------------------------------------------------------
 
 void OpenGLWidget::destroy() {
+    if (!is_initialized) {
+        if (window != nullptr) glfwDestroyWindow(window);
+        glfwTerminate();
+        return;
+    }
+
     // Cleanup
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -574,10 +1409,24 @@ void OpenGLWidget::destroy() {
     deleteInstance();
 
     glDeleteProgram(mvp_prog);
+    glDeleteProgram(layered_prog);
+    glDeleteProgram(impostor_prog);
+    glDeleteProgram(layered_impostor_prog);
+    for (auto& target : capture_targets) releaseCaptureTarget(target);
+    capture_targets.clear();
+    for (auto& readback : readbacks) {
+        if (readback.fence != nullptr) glDeleteSync(readback.fence);
+        glDeleteBuffers(1, &readback.pbo);
+    }
+    glDeleteBuffers(1, &vbo_layers);
+    glDeleteFramebuffers(1, &fbo_layers);
+    glDeleteTextures(1, &texture_layers);
+    glDeleteTextures(1, &depth_layers);
     glDeleteVertexArrays(1, &vao);
     glDeleteBuffers(1, &ibo_static);
     glDeleteBuffers(1, &vbo_static);
-    glDeleteBuffers(1, &vbo_uniforms);
+    ring_uniforms.release();
+    ring_instances.release();
     glfwDestroyWindow(window);
     glfwTerminate();
 }
@@ -593,6 +1442,7 @@ void OpenGLWidget::deleteInstance() {
 // ------------------------------------------------------------------------------------------------
 
 void OpenGLWidget::setWindowVisibility(const bool is_visible) {
+    if (window == nullptr) return;
     if (is_visible) {
         glfwShowWindow(window);
         window_visible = true;
@@ -2,12 +2,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <deque>
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
 
+#include "imaging.hpp"
 #include "opengl_primitives.hpp"
 #include "scene.hpp"
+#include "snapshot.hpp"
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
 
@@ -18,6 +22,38 @@ namespace gathering {
 constexpr auto PI2 = 2 * M_PI;
 constexpr GLuint MAX_ELEMENT_ID = 4294967295;
 constexpr glm::vec3 CAMERA_START = glm::vec3(0);
+constexpr size_t MAX_LAYERS_PER_PASS = 128;     // see shader/layered.geom
+constexpr size_t MAX_LAYERS_PER_PRIMITIVE = 4;  // see shader/layered.geom
+constexpr size_t UNIFORM_RING_REGIONS = 4;      // renderViews uses one region for all views
+constexpr size_t MAX_CAPTURE_TARGETS = 4;       // offscreen framebuffers kept by renderViews
+// uniform block "Global" (std140)
+constexpr size_t UNIFORM_BLOCK_SIZE = 3 * sizeof(glm::mat4) + 2 * sizeof(glm::vec4);
+// longest time a blocking pollReadbacks waits for a readback [ns]
+constexpr GLuint64 READBACK_TIMEOUT = 10000000000;
+
+/**
+ * @brief Level of detail of the particle meshes: accuracy of the sphere (0 = a single point)
+ * and the smallest projected diameter in pixels the level is used for.
+ */
+struct ParticleLod {
+    unsigned short accuracy;
+    float min_pixels;
+};
+constexpr size_t PARTICLE_LOD_COUNT = 4;
+constexpr ParticleLod PARTICLE_LODS[PARTICLE_LOD_COUNT] = {
+    {5, 16.f}, {3, 6.f}, {2, 2.f}, {0, 0.f}};
+constexpr size_t IMPOSTOR_LOD = PARTICLE_LOD_COUNT;  // level of the impostors, after meshes
+
+/**
+ * @brief Per particle scalar that is used to color the particles in the interactive view.
+ */
+enum class ParticleColoring { None = 0, Mass = 1, Speed = 2 };
+
+/**
+ * @brief Called with the pixels of an asynchronous readback once they are available. The
+ * pointer is only valid during the call.
+ */
+typedef std::function<void(const unsigned char* pixels)> ReadbackCallback;
 
 class OpenGLWidget {
    public:
@@ -41,12 +77,98 @@ class OpenGLWidget {
      * #define GATHERING_AUTO_HEADLESS to avoid this behavior.
      */
     void updateScene(const SceneData& scene);
+    void updateScene(const SceneSnapshot& snapshot);
+
+    /**
+     * @brief Uploads the particle data of the scene. Called by updateScene; call it before the
+     * offscreen functions below (renderViews, drawLayers).
+     */
+    void updateInstances(const SceneData& scene);
+
+    /**
+     * @brief Like updateInstances, but only uploads the particles that are visible in the
+     * given views, grouped by view (see cullParticles). The next renderViews with the same
+     * views draws every view with its own group through an indirect draw command.
+     */
+    void updateInstances(const SceneData& scene, const std::vector<ImageView>& views);
+
+    /**
+     * @brief Renders every view into an offscreen framebuffer of the given size (independent
+     * of the window, its size and its visibility) and reads the resolved image back. Depth
+     * and density are rendered into further color attachments without multisampling: in
+     * the same pass if samples is 1, else in a second pass. Particles are cut by the near
+     * and far plane of a view like solid spheres (depth clamping, see non_shaded.frag).
+     * @param samples Multisampling of the occupancy; the image is resolved before it is
+     * read. 1 = no MSAA.
+     * @param outputs One buffer (width * height pixels) per view and channel; particle ids
+     * are not supported. Offsets into the pixel buffer if a readback is active (see
+     * beginReadback).
+     * @throws std::runtime_error if the framebuffer can't be created (e.g. unsupported
+     * number of samples).
+     */
+    void renderViews(const std::vector<ImageView>& views,
+                     const int width,
+                     const int height,
+                     const int samples,
+                     const ImageOutputs& outputs);
+
+    /**
+     * @brief Renders every view into its own layer of an offscreen array texture. Views that
+     * only differ in their depth range (slices) are rendered in a single draw call; a geometry
+     * shader routes every triangle to the layers it intersects.
+     */
+    void drawLayers(const std::vector<ImageView>& views, const int width, const int height);
+
+    /**
+     * @brief Reads the layers of the last drawLayers call (one byte per pixel). If the
+     * outputs are contiguous, all layers are read with a single call.
+     * @param outputs One buffer per layer. Offsets into the pixel buffer if a readback is
+     * active (see beginReadback).
+     */
+    void readLayers(const std::vector<unsigned char*>& outputs);
+
+    /**
+     * @brief Binds a pixel buffer object of (at least) the given size as GL_PIXEL_PACK_BUFFER.
+     * All following pixel reads (glReadPixels, readLayers) are written into it
+     * asynchronously; the pointers passed to them are interpreted as offsets.
+     */
+    void beginReadback(const size_t bytes);
+
+    /**
+     * @brief Ends the active readback. The callback is called by pollReadbacks as soon as the
+     * gpu has finished the copy.
+     */
+    void endReadback(ReadbackCallback callback);
+
+    /**
+     * @brief Ends the active readback without delivering it, e.g. if rendering failed.
+     */
+    void cancelReadback();
+
+    /**
+     * @brief Hands finished readbacks to their callbacks (in the order they were issued).
+     * Readbacks whose fence fails (GL_WAIT_FAILED) are dropped without calling them.
+     * @param wait Block until all pending readbacks are finished.
+     * @throws std::runtime_error if wait and a readback didn't finish within
+     * READBACK_TIMEOUT, or if readbacks were dropped since the last blocking poll.
+     */
+    void pollReadbacks(const bool wait);
+    bool hasPendingReadbacks() const { return !pending_readbacks.empty(); }
     void setWindowVisibility(const bool is_visible);
     void setImageMode(bool is_imagemode);
     void setView(const glm::mat4& view) { this->view = view; }
     void setProjection(const glm::mat4& projection) { this->projection = projection; }
     bool isPrepared() const { return is_prepared; };
+    bool isInitialized() const { return is_initialized; };
     void setWindowSize(const int width, const int height) const;
+    void setParticleColoring(const ParticleColoring coloring) { particle_coloring = coloring; }
+
+    /**
+     * @brief Draw the particles as ray-cast sphere impostors (one point per particle) instead
+     * of instanced sphere meshes. Particles too large for a point (GL_POINT_SIZE_RANGE) are
+     * still drawn as meshes. Takes effect with the next prepareInstance.
+     */
+    void setImpostors(const bool use_impostors) { this->use_impostors = use_impostors; }
 
    private:
     void init();
@@ -54,6 +176,26 @@ class OpenGLWidget {
     void destroy();
     void buildGUI();
     void renderScene();
+    void updateCamera();
+    void pushUniforms();
+    void writeUniforms(unsigned char* uniforms) const;  // block "Global" of the current view
+    template <typename P>  // Particle or ParticleState
+    void uploadInstances(const P* particles, const size_t count);
+    void bindInstances();
+    void drawCulled(const size_t view_idx, const size_t lod);
+    float projectedDiameter(const glm::mat4& projection,
+                            const int width,
+                            const int height,
+                            const float distance = 1.f) const;
+    size_t particleLod(const float pixels, const bool triangles_only) const;
+    bool impostorFits(const float pixels) const;
+    void useParticleLod(const size_t level);
+    template <typename P>
+    glm::vec2 writeInstances(const P* particles,
+                             const size_t count,
+                             glm::vec4* instances) const;
+    GLuint particleProgram() const;
+    void prepareLayerTarget(const int width, const int height, const int layer_count);
     void deleteInstance();
     void pushStaticSceneToGPU(const std::vector<OpenGLPrimitives::Object>& scene_objects);
     OpenGLPrimitives::ObjectInfo* getObjectInfo(const std::string& name);
@@ -62,18 +204,110 @@ class OpenGLWidget {
         fprintf(stderr, "Glfw Error %d: %s\n", error, description);
     }
 
-   private:
+    /**
+     * @brief Per layer data of the layered rendering (std140 layout, see shader/layered.geom).
+     */
+    struct LayerInfo {
+        glm::mat4 view_projection;
+        glm::vec4 depth_axis;
+        glm::vec2 depth_range;
+        GLint layer;
+        GLint padding;
+    };
+
+    /**
+     * @brief Offscreen framebuffer for renderViews. Rendered into fbo_render (multisampled if
+     * samples > 1) and resolved into fbo_resolve. With channels, the depth and the density
+     * are written to the color attachments 1 and 2 of fbo_render, or of fbo_channels if
+     * fbo_render is multisampled (all attachments of a framebuffer need the same number of
+     * samples). At most
+     * MAX_CAPTURE_TARGETS are kept, the least recently used one is released first.
+     */
+    struct CaptureTarget {
+        int width = 0, height = 0, samples = 1;
+        bool channels = false;
+        size_t last_use = 0;
+        GLuint fbo_render = 0u, color_render = 0u, depth_render = 0u;
+        GLuint fbo_channels = 0u, depth_channel = 0u, density_channel = 0u;
+        GLuint fbo_resolve = 0u, color_resolve = 0u;
+    };
+    CaptureTarget& captureTarget(const int width,
+                                 const int height,
+                                 const int samples,
+                                 const bool channels);
+    static void releaseCaptureTarget(CaptureTarget& target);
+
+    /**
+     * @brief Layout of the commands in GL_DRAW_INDIRECT_BUFFER (glMultiDrawElementsIndirect).
+     */
+    struct DrawElementsIndirectCommand {
+        GLuint count;
+        GLuint instance_count;
+        GLuint first_index;
+        GLint base_vertex;
+        GLuint base_instance;
+    };
+
+    struct Readback {
+        GLuint pbo = 0u;
+        size_t capacity = 0;  // size of the pbo in bytes
+        size_t size = 0;      // size of the requested pixel data in bytes
+        GLsync fence = nullptr;
+        ReadbackCallback callback;
+    };
+
     GLFWwindow* window = nullptr;
     StopWatch<std::chrono::microseconds> stop_watch = StopWatch<std::chrono::microseconds>();
     bool window_visible = true;  // whether the glfw window is visible or not
     glm::vec3 clear_color = glm::vec3(0.09f);
     bool is_image_mode = false;
+    bool is_initialized = false;  // false without window or gl context (e.g. no display)
 
     // handler
     GLuint mvp_prog = 0u, mvp_prog_non_shaded = 0u, static_prog = 0u;
-    GLuint vbo_static = 0u, ibo_static = 0u, vbo_uniforms = 0u;
+    GLuint vbo_static = 0u, ibo_static = 0u;
     GLuint vao = 0u;
-    OpenGLPrimitives::GLBuffer<glm::mat4> buffer_transformations;
+
+    // dynamic data, written directly into persistently mapped memory
+    OpenGLPrimitives::GLRingBuffer ring_instances{3};  // vec4 per particle: position + scalar
+    OpenGLPrimitives::GLRingBuffer ring_uniforms{UNIFORM_RING_REGIONS};  // block "Global"
+
+    // instances culled per view (see updateInstances with views)
+    OpenGLPrimitives::GLRingBuffer ring_indirect{3};  // DrawElementsIndirectCommand per view
+    size_t culled_view_count = 0;                     // 0 = instances are not culled
+    std::vector<uint32_t> cull_indices;
+    std::vector<size_t> cull_offsets;
+
+    // levels of detail: the particle meshes, then the impostor (IMPOSTOR_LOD) if used
+    std::vector<OpenGLPrimitives::ObjectInfo> particle_lods;
+    size_t particle_lod = 0;  // level used in the window
+    size_t active_lod = 0;    // level swapped into "particles"
+    float particle_radius = RADIUS_PARTICLE;  // of the prepared scene
+    ParticleColoring particle_coloring = ParticleColoring::None;
+
+    // sphere impostors
+    bool use_impostors = false;
+    float max_point_size = 1.f;  // GL_POINT_SIZE_RANGE; larger particles are drawn as meshes
+    GLuint impostor_prog = 0u, layered_impostor_prog = 0u;
+    GLint impostor_shaded_location = -1;
+    GLint layered_impostor_count_location = -1, layered_impostor_viewport_location = -1;
+
+    // layered offscreen rendering
+    GLuint layered_prog = 0u, vbo_layers = 0u;
+    GLint layer_count_location = -1;
+    GLuint fbo_layers = 0u, texture_layers = 0u, depth_layers = 0u;
+    glm::ivec3 layers_size = glm::ivec3(0);  // width, height, number of layers
+
+    // offscreen rendering
+    std::vector<CaptureTarget> capture_targets;  // at most MAX_CAPTURE_TARGETS
+    size_t capture_count = 0;                    // for CaptureTarget::last_use
+
+    // asynchronous readbacks
+    std::vector<Readback> readbacks;        // pool of pixel buffer objects
+    std::deque<size_t> pending_readbacks;   // indices into readbacks, oldest first
+    std::vector<size_t> free_readbacks;     // indices into readbacks
+    size_t active_readback = SIZE_MAX;
+    size_t failed_readbacks = 0;  // dropped since the last blocking poll
 
     // view and camera
     glm::vec2 camera_rotation_angle_offset = glm::vec2(.0f, .0f);
@@ -5,10 +5,11 @@
 #include <vector>
 
 #include "gathering/glm_include.hpp"
+#include "memory.hpp"
 
 namespace gathering {
 
-constexpr float RADIUS_PARTICLE = 0.05f;  // TODO optional parameter
+constexpr float RADIUS_PARTICLE = 0.05f;  // default, see SimulationSettings::particle_radius
 constexpr float RADIUS_PARTICLE_SQR = RADIUS_PARTICLE * RADIUS_PARTICLE;
 constexpr float RADIUS_PARTICLE_2_SQR = RADIUS_PARTICLE * RADIUS_PARTICLE * 4.0f;
 constexpr float VERLET_RADIUS = RADIUS_PARTICLE * 4.0;
@@ -64,8 +65,7 @@ struct Particle {
     Particle() = delete;
     Particle(const float x, const float y, const float z) : position(glm::vec3(x, y, z)) {}
 
-    bool intersect(const Triangle& triangle) const;
-    bool intersect(const Particle& particle) const;
+    // particle-particle and particle-triangle tests need the radius: see physics.hpp
     bool intersect(const AABB& aabb) const { return bb.intersect(aabb); }
 
     glm::vec3 position = glm::vec3(0.0);
@@ -74,12 +74,16 @@ struct Particle {
     glm::vec3 new_velocity = glm::vec3(0.0);
     glm::vec3 acceleration = glm::vec3(0.0);
     float mass = 1.0;
+    float radius = RADIUS_PARTICLE;
     AABB bb;
 
+    int particle_grid_level = 0;  // see HierarchicalGrid
     vec3i particle_grid_position = vec3i(0);
     std::vector<size_t> close_triangles;
 };
 
+typedef std::vector<Particle, Memory::LargeAllocator<Particle>> ParticleVector;
+
 }  // namespace gathering
 
 #endif
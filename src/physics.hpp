@@ -0,0 +1,159 @@
+#ifndef GATHERING_PHYSICS_H
+#define GATHERING_PHYSICS_H
+
+#include "gathering/glm_include.hpp"
+#include "particle.hpp"
+
+namespace gathering {
+
+/**
+ * @brief Parameters of the particle physics as policies for the kernels of a step. A kernel
+ * is a template on the policy and reads physics.radiusOf(particle) etc.; with one of the
+ * Fixed policies these are compile time constants and everything derived from them is
+ * folded. dispatch selects the fixed policy that matches the parameters of a scene or falls
+ * back to Parameters, which holds them at run time, or to Polydisperse.
+ */
+namespace Physics {
+
+/**
+ * @brief Generic policy: the parameters are read at run time.
+ */
+struct Parameters {
+    float radius = RADIUS_PARTICLE;  // of all particles
+    float restitution = 0.5f;        // of collisions; 0 = inelastic, 1 = elastic
+    float drag = 1.01f;              // the velocities are divided by this every step
+    bool polydisperse = false;       // every particle has its own radius (Particle::radius)
+
+    float radiusOf(const Particle&) const { return radius; }
+};
+
+/**
+ * @brief Generic policy for particles of different sizes.
+ */
+struct Polydisperse : Parameters {
+    explicit Polydisperse(const Parameters& parameters) : Parameters(parameters) {}
+
+    float radiusOf(const Particle& particle) const { return particle.radius; }
+};
+
+/**
+ * @brief Precompiled policy; the values are given in thousandths (no float template
+ * arguments before C++20).
+ */
+template <int RADIUS_PERMILLE, int RESTITUTION_PERMILLE, int DRAG_PERMILLE>
+struct Fixed {
+    static constexpr float radius = RADIUS_PERMILLE / 1000.f;
+    static constexpr float restitution = RESTITUTION_PERMILLE / 1000.f;
+    static constexpr float drag = DRAG_PERMILLE / 1000.f;
+
+    static constexpr float radiusOf(const Particle&) { return radius; }
+    static bool matches(const Parameters& p) {
+        return !p.polydisperse && p.radius == radius && p.restitution == restitution &&
+               p.drag == drag;
+    }
+};
+
+typedef Fixed<50, 500, 1010> Default;  // RADIUS_PARTICLE and the former constants
+typedef Fixed<25, 500, 1010> Fine;
+typedef Fixed<100, 500, 1010> Coarse;
+
+/**
+ * @brief Calls func(policy) with the precompiled policy of the parameters if there is one,
+ * else with the parameters themselves.
+ */
+template <typename Func>
+void dispatch(const Parameters& parameters, Func func) {
+    if (parameters.polydisperse) {
+        func(Polydisperse(parameters));
+    } else if (Default::matches(parameters)) {
+        func(Default());
+    } else if (Fine::matches(parameters)) {
+        func(Fine());
+    } else if (Coarse::matches(parameters)) {
+        func(Coarse());
+    } else {
+        func(parameters);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+template <typename Policy>
+AABB boundingBox(const Particle& particle, const Policy& physics) {
+    const float radius = physics.radiusOf(particle);
+    return AABB(particle.position - radius, particle.position + radius);
+}
+
+template <typename Policy>
+bool intersect(const Particle& a, const Particle& b, const Policy& physics) {
+    glm::vec3 diff = b.position - a.position;
+    const float distance = physics.radiusOf(a) + physics.radiusOf(b);
+    return glm::dot(diff, diff) < distance * distance;
+}
+
+template <typename Policy>
+bool intersect(const Particle& particle, const Triangle& t, const Policy& physics) {
+    using glm::vec3;
+    const vec3& position = particle.position;
+    const float radius = physics.radiusOf(particle);
+    const float radius_sqr = radius * radius;
+
+    // 1. sphere VS plane
+    vec3 v = position - t.a;
+    float distance = glm::abs(glm::dot(v, t.normal));
+    if (distance > radius) {
+        return false;
+    }
+
+    // 2. sphere VS triangle vertices
+    glm::vec3 da = position - t.a;
+    if (glm::dot(da, da) <= radius_sqr) return true;
+    glm::vec3 db = position - t.b;
+    if (glm::dot(db, db) <= radius_sqr) return true;
+    glm::vec3 dc = position - t.c;
+    if (glm::dot(dc, dc) <= radius_sqr) return true;
+
+    // 3. sphere VS triangle edges
+    // AB
+    vec3 ab = t.b - t.a;
+    vec3 as = position - t.a;
+    float scale = glm::dot(as, ab) / glm::dot(ab, ab);
+    if (scale > 0.f && scale < 1.f) {
+        glm::vec3 tmp = as - ab * scale;
+        if (glm::dot(tmp, tmp) <= radius_sqr) return true;
+    }
+
+    // AC
+    vec3 ac = t.c - t.a;
+    as = position - t.a;
+    scale = glm::dot(as, ac) / glm::dot(ac, ac);
+    if (scale > 0.f && scale < 1.f) {
+        glm::vec3 tmp = as - ac * scale;
+        if (glm::dot(tmp, tmp) <= radius_sqr) return true;
+    }
+
+    // CB
+    vec3 cb = t.b - t.c;
+    as = position - t.a;
+    scale = glm::dot(as, cb) / glm::dot(cb, cb);
+    if (scale > 0.f && scale < 1.f) {
+        glm::vec3 tmp = as - cb * scale;
+        if (glm::dot(tmp, tmp) <= radius_sqr) return true;
+    }
+
+    // 4. sphere VS triangle inside
+    vec3 p = position + distance * t.normal;  // center of sphere projected to triangle plane
+    float m1 = ((t.b.y - t.c.y) * (p.x - t.c.x) + (t.c.x - t.b.x) * (p.y - t.c.y)) /
+               ((t.b.y - t.c.y) * (t.a.x - t.c.x) + (t.c.x - t.b.x) * (t.a.y - t.c.y));
+    if (m1 < 0 || m1 > 1) return false;
+    float m2 = ((t.c.y - t.a.y) * (p.x - t.c.x) + (t.a.x - t.c.x) * (p.y - t.c.y)) /
+               ((t.b.y - t.c.y) * (t.a.x - t.c.x) + (t.c.x - t.b.x) * (t.a.y - t.c.y));
+    if (m2 < 0) return false;
+    if (m1 + m2 > 1) return false;
+    return true;
+}
+
+}  // namespace Physics
+}  // namespace gathering
+
+#endif
@@ -1,5 +1,6 @@
 #include "scene.hpp"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <random>
@@ -11,23 +12,36 @@ namespace gathering {
 
 using glm::vec3;
 
-SceneData::SceneData(const char* file) {
+SceneData::SceneData(const char* file,
+                     const float particle_radius,
+                     const float particle_radius_stddev,
+                     const float particle_grid_cell_radii,
+                     const Memory::Placement& placement)
+    : particle_radius(particle_radius),
+      particle_radius_stddev(particle_radius_stddev),
+      particle_grid_cell_radii(particle_grid_cell_radii),
+      placement(placement),
+      particles(Memory::LargeAllocator<Particle>(placement)) {
     loadObject(file);
     close_particles.reserve(32);
-
-    vec3i resolution = (vessel_bb.max - vessel_bb.min) / glm::vec3(RADIUS_PARTICLE * 6);
-    particle_grid = Grid(resolution, vessel_bb);
+    particle_grid = HierarchicalGrid(
+        vessel_bb, particle_radius, particle_radius, particle_grid_cell_radii, placement);
 }
 
 // TODO improve
 void SceneData::addParticles(const int n, const float mass_mean, const float mass_stddev) {
     std::default_random_engine generator;
     std::normal_distribution<float> distribution(mass_mean, mass_stddev);
+    std::default_random_engine radius_generator;
+    std::normal_distribution<float> radius_distribution(particle_radius,
+                                                        particle_radius_stddev);
     Array3D<bool> inside_cells(AMOUNT_CELLS.x,
                                AMOUNT_CELLS.y,
                                AMOUNT_CELLS.z,
                                false,
-                               false);  // TODO replace with grid
+                               0,
+                               OutOfDomain::Reject,
+                               placement);  // TODO replace with grid
 
     vec3 direction = vec3(1.0, 0.0, 0.0);
     for (int z = 0; z < AMOUNT_CELLS.z; ++z) {
@@ -111,8 +125,12 @@ void SceneData::addParticles(const int n, const float mass_mean, const float mas
         }
     }
 
-    // add particles
-    for (size_t i = 0; i < inside_cells_eroded.size(); i += inside_cells_eroded.size() / n) {
+    // add particles; at most one per cell
+    if (n <= 0) return;
+    const size_t step = std::max<size_t>(1, inside_cells_eroded.size() / n);
+    // exactly: the first touch of the pages splits the capacity (see Memory::Placement)
+    particles.reserve(particles.size() + (inside_cells_eroded.size() + step - 1) / step);
+    for (size_t i = 0; i < inside_cells_eroded.size(); i += step) {
         vec3 cell = inside_cells_eroded[i];
         vec3 pos = vessel_bb.min;
         pos.x += ((vessel_bb.max.x - vessel_bb.min.x) / AMOUNT_CELLS.x) * (cell.x + 0.5f);
@@ -120,12 +138,21 @@ void SceneData::addParticles(const int n, const float mass_mean, const float mas
         pos.z += ((vessel_bb.max.z - vessel_bb.min.z) / AMOUNT_CELLS.z) * (cell.z + 0.5f);
         Particle p = Particle(pos.x, pos.y, pos.z);
         p.mass = std::abs(distribution(generator));
+        p.radius = particle_radius;
+        if (polydisperse()) {
+            p.radius = glm::clamp(radius_distribution(radius_generator),
+                                  particle_radius / MAX_RADIUS_RATIO,
+                                  particle_radius * MAX_RADIUS_RATIO);
+        }
 
         // add particles to particle grid
-        p.particle_grid_position = particle_grid.coords(p.position);
-        particle_grid.insert(p.particle_grid_position, i);
+        p.particle_grid_level = particle_grid.level(p.radius);
+        p.particle_grid_position = particle_grid.coords(p.particle_grid_level, p.position);
+        const size_t idx = particles.size();
+        particle_grid.insert(p.particle_grid_level, p.particle_grid_position, idx);
         particles.push_back(p);
     }
+    if (polydisperse()) rebuildParticleGrid();
 
     // reserve memory for collisions
     collisions_particle.reserve(collisions_particle.size() + n / 2);
@@ -241,12 +268,13 @@ void SceneData::loadObject(const char* path) {
 
     // create grid
     vec3i resolution = (vessel_bb.max - vessel_bb.min) / max_triangle_size;
-    grid = Grid(resolution, vessel_bb);
+    grid = Grid(resolution, vessel_bb, placement);
 
     // insert triangles to grid
+    Memory::ScratchVector<vec3i> affected_coords{Memory::ArenaAllocator<vec3i>(scratch)};
     for (size_t i = 0; i < triangles.size(); i++) {
         const Triangle& t = triangles[i];
-        std::vector<vec3i> affected_coords;
+        affected_coords.clear();
         gridCoordsArea(t.bb, affected_coords);
         for (const auto& coords : affected_coords) {
             cells.at(coords.x, coords.y, coords.z).push_back(i);
@@ -257,6 +285,7 @@ void SceneData::loadObject(const char* path) {
     }
 
 #ifdef GATHERING_DEBUGPRINTS
+    std::cout << "Triangles beyond the grid: " << cells.outOfDomainCount() << std::endl;
     std::cout << "Loading time [ms]: " << stopwatch.stop() << std::endl;
 #endif
 }
@@ -271,7 +300,28 @@ vec3i SceneData::gridCoords(const glm::vec3& pos) const {
 
 // ------------------------------------------------------------------------------------------------
 
-void SceneData::gridCoordsArea(const AABB& aabb, std::vector<vec3i>& affected_cells) const {
+void SceneData::rebuildParticleGrid() {
+    float min_radius = particle_radius, max_radius = particle_radius;
+    for (const Particle& p : particles) {
+        min_radius = std::min(min_radius, p.radius);
+        max_radius = std::max(max_radius, p.radius);
+    }
+    max_particle_radius = max_radius;
+
+    particle_grid = HierarchicalGrid(
+        vessel_bb, min_radius, max_radius, particle_grid_cell_radii, placement);
+    for (size_t i = 0; i < particles.size(); ++i) {
+        Particle& p = particles[i];
+        p.particle_grid_level = particle_grid.level(p.radius);
+        p.particle_grid_position = particle_grid.coords(p.particle_grid_level, p.position);
+        particle_grid.insert(p.particle_grid_level, p.particle_grid_position, i);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void SceneData::gridCoordsArea(const AABB& aabb,
+                               Memory::ScratchVector<vec3i>& affected_cells) const {
     // in any cell at all?
     if (!aabb.intersect(vessel_bb)) {
         return;
@@ -279,15 +329,15 @@ void SceneData::gridCoordsArea(const AABB& aabb, std::vector<vec3i>& affected_ce
     affected_cells.reserve(4);
 
     vec3 grid_size = vessel_bb.max - vessel_bb.min;  // TODO pre compute?
-    vec3i coords_min =
-        ((aabb.min - vessel_bb.min) * (glm::vec<3, float>)AMOUNT_CELLS) / grid_size;
-    vec3i coords_max =
-        ((aabb.max - vessel_bb.min) * (glm::vec<3, float>)AMOUNT_CELLS) / grid_size;
-
-    // objects that are equal to the vessel bb
-    if (coords_max.x >= AMOUNT_CELLS.x) coords_max.x--;
-    if (coords_max.y >= AMOUNT_CELLS.y) coords_max.y--;
-    if (coords_max.z >= AMOUNT_CELLS.z) coords_max.z--;
+    vec3 first = ((aabb.min - vessel_bb.min) * (glm::vec<3, float>)AMOUNT_CELLS) / grid_size;
+    vec3 last = ((aabb.max - vessel_bb.min) * (glm::vec<3, float>)AMOUNT_CELLS) / grid_size;
+
+    // objects that reach beyond the grid, not just up to its border, are counted by the
+    // cells (OutOfDomain::Count); only cells of the grid are used, so they can be read
+    // unchecked
+    cells.countOutside(vec3i(glm::floor(first)), vec3i(glm::ceil(last)) - 1);
+    vec3i coords_min = cells.clamp(vec3i(first));
+    vec3i coords_max = cells.clamp(vec3i(last));
 
     // all cells that are overlapping the bounding box
     vec3 diff = coords_max - coords_min;
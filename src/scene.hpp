@@ -7,6 +7,7 @@
 
 #include "container.hpp"
 #include "gathering/glm_include.hpp"
+#include "memory.hpp"
 #include "opengl_primitives.hpp"
 #include "particle.hpp"
 
@@ -17,27 +18,48 @@ constexpr vec3i AMOUNT_CELLS = vec3i(200);  // TODO get rid
 
 struct SceneData {
    public:
-    SceneData(const char* file);
+    SceneData(const char* file,
+              const float particle_radius = RADIUS_PARTICLE,
+              const float particle_radius_stddev = 0.f,
+              const float particle_grid_cell_radii = 6.f,
+              const Memory::Placement& placement = Memory::Placement());
+    // every k-th inside cell of the vessel grid gets one (see Simulation::addParticles); the
+    // particles are inserted into the particle grid by their index
     void addParticles(const int n, const float mass_mean, const float mass_stddev);
-    void gridCoordsArea(const AABB& aabb, std::vector<vec3i>& affected_cells) const;
+    // the cells of the vessel grid that overlap the aabb; never outside of the grid
+    void gridCoordsArea(const AABB& aabb, Memory::ScratchVector<vec3i>& affected_cells) const;
     vec3i gridCoords(const glm::vec3& pos) const;
 
-    std::vector<Particle> particles;
+    // radii of new particles: normal distribution, at most MAX_RADIUS_RATIO times smaller or
+    // larger than the mean
+    static constexpr float MAX_RADIUS_RATIO = 4.f;
+    float particle_radius;  // mean
+    float particle_radius_stddev;
+    float max_particle_radius = particle_radius;
+    bool polydisperse() const { return particle_radius_stddev > 0.f; }
+    float particle_grid_cell_radii;  // see HierarchicalGrid
+    Memory::Placement placement;     // of the particles and the grids
+
+    ParticleVector particles;
     std::vector<Triangle> triangles;
     glm::vec3 global_force = glm::vec3(0.0f);
     OpenGLPrimitives::Object vessel;
     AABB vessel_bb = AABB(glm::vec3(std::numeric_limits<float>::infinity()),
                           glm::vec3(-std::numeric_limits<float>::infinity()));
-    Grid particle_grid = Grid();
+    HierarchicalGrid particle_grid;
     std::vector<particle_pair>
         collisions_particle;  // memory for reported collisions between two particles
+    std::vector<std::vector<particle_pair>>
+        collisions_particle_threads;  // found by the threads of the cell pair search
     std::vector<size_t> collisions_vessel;
-    std::vector<size_t> close_particles;
-    Array3D<std::vector<size_t>> cells =
-        Array3D<std::vector<size_t>>(AMOUNT_CELLS.x, AMOUNT_CELLS.y, AMOUNT_CELLS.z, {});
+    std::vector<size_t> close_particles;  // keeps its capacity from step to step
+    Memory::Arena scratch;                // per step, e.g. the cells overlapped by a particle
+    Array3D<std::vector<size_t>> cells = Array3D<std::vector<size_t>>(
+        AMOUNT_CELLS.x, AMOUNT_CELLS.y, AMOUNT_CELLS.z, {}, 0, OutOfDomain::Count, placement);
 
    private:
     void loadObject(const char* path);
+    void rebuildParticleGrid();
     Grid grid = Grid();
 
     // properties of the scene
@@ -4,85 +4,299 @@
 #include <stdlib.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <thread>
 
-#include "opengl_widget.hpp"
+#include "imaging.hpp"
+#include "meta.hpp"
+#include "physics.hpp"
 #include "scene.hpp"
+#include "snapshot.hpp"
+#include "software_renderer.hpp"
+#include "trace.hpp"
+#ifndef GATHERING_HEADLESS
+#include "opengl_widget.hpp"
+#endif
 
 namespace gathering {
 
 // --------------------------------------------------------------------------------------------
 
+namespace {
+
+// the channels in the order they are stored in an ImageContainer and their bytes per pixel
+constexpr unsigned int CHANNELS[] = {ImageChannel::OCCUPANCY,
+                                     ImageChannel::DEPTH,
+                                     ImageChannel::DENSITY,
+                                     ImageChannel::PARTICLE_ID};
+constexpr size_t CHANNEL_PIXEL_SIZES[] = {1, sizeof(float), sizeof(float), sizeof(uint32_t)};
+
+size_t alignedSize(const size_t bytes) {
+    const size_t alignment = ImageContainer::IMAGE_ALIGNMENT;
+    return (bytes + alignment - 1) / alignment * alignment;
+}
+
+template <typename T>
+std::vector<T*> channelImages(const uintptr_t base,
+                              const size_t image_size,
+                              const size_t count) {
+    std::vector<T*> images;
+    for (size_t i = 0; i < count; ++i) {
+        images.push_back(reinterpret_cast<T*>(base + i * image_size * sizeof(T)));
+    }
+    return images;
+}
+
+/**
+ * @brief Pointers to the images of all channels of a container, if its block started at base.
+ * With base = 0 these are offsets into a pixel buffer with the layout of the container.
+ */
+ImageOutputs imageOutputs(const ImageContainer& layout, const uintptr_t base) {
+    const size_t size = layout.imageSize(), count = layout.content_count;
+    auto start = [&](unsigned int channel) { return base + layout.channelOffset(channel); };
+    ImageOutputs outputs;
+    outputs.occupancy =
+        channelImages<unsigned char>(start(ImageChannel::OCCUPANCY), size, count);
+    if (layout.channels & ImageChannel::DEPTH) {
+        outputs.depth = channelImages<float>(start(ImageChannel::DEPTH), size, count);
+    }
+    if (layout.channels & ImageChannel::DENSITY) {
+        outputs.density = channelImages<float>(start(ImageChannel::DENSITY), size, count);
+    }
+    if (layout.channels & ImageChannel::PARTICLE_ID) {
+        outputs.ids = channelImages<uint32_t>(start(ImageChannel::PARTICLE_ID), size, count);
+    }
+    return outputs;
+}
+
+}  // namespace
+
+// --------------------------------------------------------------------------------------------
+
+void ImageContainer::AlignedDelete::operator()(unsigned char* p) const {
+    ::operator delete[](p, std::align_val_t(IMAGE_ALIGNMENT));
+}
+
+ImageContainer::ImageContainer(const ImageContainer& other) { *this = other; }
+
+ImageContainer& ImageContainer::operator=(const ImageContainer& other) {
+    if (this == &other) return *this;
+    reset(other.width, other.height, other.content_count, other.channels);
+    if (other.data() != nullptr && blockSize() != 0) {
+        std::memcpy(data(), other.data(), blockSize());
+    }
+    return *this;
+}
+
+size_t ImageContainer::channelOffset(const unsigned int channel) const {
+    size_t offset = 0;
+    for (size_t c = 0; c < 4 && CHANNELS[c] != channel; ++c) {
+        if (channels & CHANNELS[c]) offset += alignedSize(byteSize() * CHANNEL_PIXEL_SIZES[c]);
+    }
+    return offset;
+}
+
+size_t ImageContainer::blockSize() const {
+    size_t size = 0;
+    for (size_t c = 0; c < 4; ++c) {
+        if (channels & CHANNELS[c]) size += alignedSize(byteSize() * CHANNEL_PIXEL_SIZES[c]);
+    }
+    return size;
+}
+
+void ImageContainer::reset(const size_t width,
+                           const size_t height,
+                           const size_t count,
+                           const unsigned int channels) {
+    this->width = width;
+    this->height = height;
+    this->channels = channels | ImageChannel::OCCUPANCY;
+    content_count = count;
+    if (blockSize() <= capacity) return;
+
+    capacity = blockSize();
+    block.reset(static_cast<unsigned char*>(
+                    ::operator new[](capacity, std::align_val_t(IMAGE_ALIGNMENT))),
+                AlignedDelete());
+}
+
 void ImageContainer::clear() { content_count = 0; }
 
 void ImageContainer::free() {
     content_count = 0;
-    images.clear();
+    block.reset();
+    capacity = 0;
 }
 
-void* ImageContainer::data(const size_t size) {
-    if (content_count >= images.size()) {
-        images.push_back(std::vector<unsigned char>());
-    }
+// --------------------------------------------------------------------------------------------
 
-    if (images[content_count].capacity() != size) {
-        images[content_count].resize(size);
-    }
+namespace {
 
-    return images[content_count++].data();
+// cell size of the particle grid in radii: the quadrant lookup of PerParticle needs at least
+// 4, the half shell of CellPairs only one diameter
+float particleGridCellRadii(const ParticleBroadPhase broad_phase) {
+    return broad_phase == ParticleBroadPhase::CellPairs ? 2.f : 6.f;
 }
 
+}  // namespace
+
 // --------------------------------------------------------------------------------------------
 
 struct Simulation::SimulationImpl {
    public:
-    SimulationImpl(const char* file) : scene(SceneData(file)), gl(OpenGLWidget()) {}
+    SimulationImpl(const char* file, const SimulationSettings& settings)
+        : physics_workers(threadCount(settings.physics_threads), settings.numa_first_touch),
+          scene(SceneData(file,
+                          settings.particle_radius,
+                          settings.particle_radius_stddev,
+                          particleGridCellRadii(settings.particle_broad_phase),
+                          Memory::Placement{settings.huge_pages,
+                                            settings.numa_first_touch ? &physics_workers
+                                                                      : nullptr})),
+          software_renderer(settings.imaging_threads),
+          impostors(settings.impostors),
+          recording(!settings.trace_file.empty()) {
+        physics.radius = settings.particle_radius;
+        physics.restitution = settings.restitution;
+        physics.drag = settings.drag;
+        physics.polydisperse = scene.polydisperse();
+    }
+    WorkerPool physics_workers;  // settings.physics_threads; before the scene, see Placement
     SceneData scene;
-    OpenGLWidget gl;
+    Physics::Parameters physics;
+    SoftwareRenderer software_renderer;
+    bool impostors;
+    SnapshotBuffer<SceneSnapshot> snapshots;  // simulation thread -> render thread
+    std::future<void> stepping;               // runStepsAsync
+    ForceSchedule async_schedule;
+    Trace::Clock::time_point run_begin;  // of the latest run; its events are dumped
+    Trace::Recording recording;          // settings.trace_file; after everything that can fail
+
+#ifndef GATHERING_HEADLESS
+    /**
+     * @brief The widget (and with it the glfw window and the gl context) is created on first
+     * use. Headless runs never touch the windowing system.
+     */
+    OpenGLWidget& gl() {
+        if (!widget) {
+            widget = std::make_unique<OpenGLWidget>();
+            widget->setImpostors(impostors);
+            gl_thread = std::this_thread::get_id();
+        }
+        return *widget;
+    }
+
+    /**
+     * @brief Whether the widget exists and may be used: its gl context and glfw only work on
+     * the thread that created them (not e.g. in runStepsAsync).
+     */
+    bool hasGL() const { return widget != nullptr && std::this_thread::get_id() == gl_thread; }
+
+    /**
+     * @brief Destroys the widget, if any; gl() creates it again.
+     */
+    void releaseGL() {
+        if (!widget) return;
+        if (std::this_thread::get_id() != gl_thread) {
+            throw std::runtime_error(
+                "The gl context can only be released on the thread that created it");
+        }
+        widget.reset();
+    }
+
+   private:
+    std::unique_ptr<OpenGLWidget> widget;
+    std::thread::id gl_thread;
+#endif
 };
 
-Simulation::~Simulation() = default;
+Simulation::~Simulation() {
+    waitSteps();
+    try {
+        wait_images();
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+    }
+}
 
 Simulation::Simulation(const char* file, const float dt, const SimulationSettings& settings)
     : dt(dt), settings(settings) {
-    impl = std::make_unique<SimulationImpl>(file);
+#ifdef GATHERING_HEADLESS
+    this->settings.headless = true;
+#endif
+    impl = std::make_unique<SimulationImpl>(file, this->settings);
 };
 
 // --------------------------------------------------------------------------------------------
 
+bool Simulation::prepareDisplay([[maybe_unused]] const bool headless) {
+#ifdef GATHERING_HEADLESS
+    return false;
+#else
+    if (settings.headless) return false;
+    if (headless) {
+        if (impl->hasGL()) impl->gl().setWindowVisibility(false);
+        return false;
+    }
+
+    if (!impl->gl().isInitialized()) {
+        std::cerr << "No opengl context available. Switching to headless mode." << std::endl;
+        settings.headless = true;
+        return false;
+    }
+
+    impl->gl().setWindowVisibility(true);
+    if (!impl->gl().isPrepared()) impl->gl().prepareInstance(impl->scene);
+    return true;
+#endif
+}
+
+// --------------------------------------------------------------------------------------------
+
 void Simulation::computeFrame(ForceSchedule& schedule,
                               const bool headless,
                               const size_t max_frame) {
-    uint64_t frame_count = 0;  // for FPS; resets to 0 every second
+    [[maybe_unused]] uint64_t frame_count = 0;  // for FPS; resets to 0 every second
     size_t step_count = 0;     // not reset
     std::chrono::microseconds t_sum = std::chrono::microseconds(0);
-    if (!impl->gl.isPrepared()) impl->gl.prepareInstance(impl->scene);
+    const bool display = prepareDisplay(headless);
+    if (display && settings.render_thread) {
+        computeFrameThreaded(schedule, max_frame);
+        return;
+    }
+    RenderPacer pacer(settings.render_interval_steps, settings.render_budget_ms);
 
     while (true) {
-        auto t_start = std::chrono::high_resolution_clock::now();
+        [[maybe_unused]] auto t_start = std::chrono::high_resolution_clock::now();
 
         // 1. update scene
-        update(dt);
-        if (schedule.size() != 0) {
-            impl->scene.global_force = schedule[0].second;
-            schedule.front().first -= dt;
-            if (schedule.front().first <= 0.f) {
-#ifdef GATHERING_DEBUGPRINTS
-                std::cout << schedule.size() << std::endl;
-#endif
-                schedule.erase(schedule.begin());
-            }
-        } else {
-            impl->scene.global_force = glm::vec3(0.);
-        }
+        step(schedule);
 
         // 2. (optional) display scene
-        if (!headless) {
-            impl->gl.updateScene(impl->scene);
-            impl->gl.renderFrame();
+#ifndef GATHERING_HEADLESS
+        if (impl->hasGL()) {
+            PhaseTimer readback_timer;
+            impl->gl().pollReadbacks(false);  // deliver finished images
+            readback_timer.lap(step_profile.readback_us, "readback");
+        }
+        const bool last_step = max_frame != 0 && step_count + 1 >= max_frame;
+        if (display && (last_step || pacer.due(step_count + 1))) {
+            TRACE_SCOPE("render");
+            StopWatch<std::chrono::microseconds> render_watch;
+            impl->gl().updateScene(impl->scene);
+            impl->gl().renderFrame();
+            long long render_us = render_watch.stop();
+            pacer.rendered(render_us);
+            step_profile.render_us += double(render_us);
         }
+#endif
 
 #ifdef GATHERING_DEBUGPRINTS
         // meta
@@ -108,44 +322,172 @@ void Simulation::computeFrame(ForceSchedule& schedule,
 
 // --------------------------------------------------------------------------------------------
 
-// TODO improve
-void Simulation::update(const float dt) {
-    const float max_speed = 2.0f * RADIUS_PARTICLE / dt;
-    const float max_speed_sqr = max_speed * max_speed;
+void Simulation::computeFrameThreaded([[maybe_unused]] ForceSchedule& schedule,
+                                      [[maybe_unused]] const size_t max_frame) {
+#ifndef GATHERING_HEADLESS
+    std::atomic<bool> done(false);
+    RenderPacer pacer(settings.render_interval_steps, settings.render_budget_ms);
+
+    std::atomic<size_t> step_count(0);
+
+    // simulation: runs as fast as it can and publishes every n-th finished step
+    std::thread simulation([&]() {
+        while (!done.load(std::memory_order_relaxed)) {
+            step(schedule);
+            const size_t steps = step_count.fetch_add(1, std::memory_order_relaxed) + 1;
+            if (pacer.stepDue(steps)) {
+                TRACE_SCOPE("snapshot");
+                impl->snapshots.back().capture(impl->scene, steps);
+                impl->snapshots.publish();
+            }
+            if (max_frame != 0 && steps >= max_frame) break;
+        }
+        done.store(true);
+    });
 
-    // move particles
-    for (auto& particle : impl->scene.particles) {
-        particle.velocity +=
-            ((particle.acceleration + impl->scene.global_force) / particle.mass) * dt;
+#ifdef GATHERING_DEBUGPRINTS
+    // fps: simulated steps per second, like computeFrame; also the rendered frames
+    auto t_print = std::chrono::steady_clock::now();
+    size_t printed_steps = 0, frame_count = 0;
+#endif
 
-        // max speed
-        if (glm::dot(particle.velocity, particle.velocity) >= max_speed_sqr) {
+    // rendering: draws the latest published step; throttled by the display (vsync) and the
+    // budget. With interpolation, the display lags one published step behind and blends from
+    // the previous to the latest step according to the wall time.
+    SceneSnapshot previous, current, interpolated;
+    while (!done.load()) {
 #ifdef GATHERING_DEBUGPRINTS
-            std::cout << "too fast" << std::endl;
+        auto t_now = std::chrono::steady_clock::now();
+        if (t_now - t_print >= std::chrono::seconds(1)) {
+            const float seconds = std::chrono::duration<float>(t_now - t_print).count();
+            const size_t steps = step_count.load(std::memory_order_relaxed);
+            std::cout << "fps: " << (steps - printed_steps) / seconds
+                      << " (rendered: " << frame_count / seconds << ")" << std::endl;
+            t_print = t_now;
+            printed_steps = steps;
+            frame_count = 0;
+        }
 #endif
-            particle.velocity = glm::normalize(particle.velocity) * max_speed * 0.95f;
+        PhaseTimer readback_timer;
+        impl->gl().pollReadbacks(false);  // deliver finished images
+        readback_timer.lap(step_profile.readback_us, "readback");
+        if (impl->gl().closed() || !pacer.budgetAllows()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        TRACE_SCOPE("render");
+        StopWatch<std::chrono::microseconds> render_watch;
+        const SceneSnapshot& latest = impl->snapshots.latest();
+        if (settings.render_interpolation) {
+            if (latest.step != current.step) {
+                std::swap(previous, current);
+                current = latest;
+            }
+            interpolated.interpolate(previous, current, std::chrono::steady_clock::now());
+            impl->gl().updateScene(interpolated);
+        } else {
+            impl->gl().updateScene(latest);
         }
+        impl->gl().renderFrame();
+        long long render_us = render_watch.stop();
+        pacer.rendered(render_us);
+        step_profile.render_us += double(render_us);
+#ifdef GATHERING_DEBUGPRINTS
+        frame_count++;
+#endif
+    }
+    simulation.join();
 
-        particle.old_position = particle.position;
-        particle.position += particle.velocity * dt;
-        particle.bb =
-            AABB(particle.position - RADIUS_PARTICLE, particle.position + RADIUS_PARTICLE);
+    // final state
+    impl->gl().updateScene(impl->scene);
+    impl->gl().renderFrame();
+#endif
+}
 
-        // clear particle grid
-        // TODO use coherence?
-        impl->scene.particle_grid.clear(particle.particle_grid_position);
+// --------------------------------------------------------------------------------------------
+
+void Simulation::step(ForceSchedule& schedule) {
+    TRACE_SCOPE("step");
+    update(dt);
+    if (schedule.size() != 0) {
+        impl->scene.global_force = schedule[0].second;
+        schedule.front().first -= dt;
+        if (schedule.front().first <= 0.f) {
+#ifdef GATHERING_DEBUGPRINTS
+            std::cout << schedule.size() << std::endl;
+#endif
+            schedule.erase(schedule.begin());
+            Trace::instant("force changed");
+        }
+    } else {
+        impl->scene.global_force = glm::vec3(0.);
     }
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::update(const float dt) {
+    Physics::dispatch(impl->physics, [&](const auto& physics) { update(physics, dt); });
+}
+
+// --------------------------------------------------------------------------------------------
+
+// TODO improve
+template <typename Policy>
+void Simulation::update(const Policy& physics, const float dt) {
+    StepProfile& profile = step_profile;
+    PhaseTimer timer;
+
+    // move particles; the threads split the particles like the first touch of their pages
+    // (SimulationSettings::numa_first_touch)
+    WorkerPool& workers = impl->physics_workers;
+    ParticleVector& particles = impl->scene.particles;
+    std::vector<size_t> speed_clamps(workers.size(), 0);
+    workers.parallelFor(particles.size(), [&](size_t begin, size_t end, unsigned int t) {
+        for (size_t i = begin; i < end; ++i) {
+            Particle& particle = particles[i];
+            particle.velocity +=
+                ((particle.acceleration + impl->scene.global_force) / particle.mass) * dt;
+
+            // max speed: the particle must not skip a particle or the vessel within one step
+            const float max_speed = 2.0f * physics.radiusOf(particle) / dt;
+            if (glm::dot(particle.velocity, particle.velocity) >= max_speed * max_speed) {
+#ifdef GATHERING_DEBUGPRINTS
+                std::cout << "too fast" << std::endl;
+#endif
+                particle.velocity = glm::normalize(particle.velocity) * max_speed * 0.95f;
+                ++speed_clamps[t];
+            }
 
+            particle.old_position = particle.position;
+            particle.position += particle.velocity * dt;
+            particle.bb = Physics::boundingBox(particle, physics);
+        }
+    });
+    for (const size_t count : speed_clamps) profile.speed_clamps += count;
+    timer.lap(profile.integrate_us, "integrate");
+
+    // update particle grid
+    // TODO use coherence?
+    impl->scene.particle_grid.clear();
     for (size_t i = 0; i < impl->scene.particles.size(); ++i) {
         Particle& particle = impl->scene.particles[i];
-        // update particle grid
-        particle.particle_grid_position = impl->scene.particle_grid.coords(particle.position);
-        impl->scene.particle_grid.insert(particle.particle_grid_position, i);
+        particle.particle_grid_position =
+            impl->scene.particle_grid.coords(particle.particle_grid_level, particle.position);
+        impl->scene.particle_grid.insert(
+            particle.particle_grid_level, particle.particle_grid_position, i);
     }
+    if (settings.particle_broad_phase == ParticleBroadPhase::CellPairs) {
+        impl->scene.particle_grid.sortOccupied();  // the cell pairs are found block by block
+    }
+    timer.lap(profile.grid_us, "grid");
 
     // collision with particles
     impl->scene.collisions_particle.clear();
-    findCollisionsParticles();
+    findCollisionsParticles(physics);
+    timer.lap(profile.particle_collisions_us, "particle collisions");
+    profile.particle_contacts += impl->scene.collisions_particle.size();
 
     // TODO handle multiple collisions
     for (const auto& collision : impl->scene.collisions_particle) {
@@ -157,18 +499,21 @@ void Simulation::update(const float dt) {
         double dx = glm::dot(dpos, dpos) - glm::dot(dpos + dvel, dpos + dvel);
         // particles move towards each other?
         if (dx <= 0.0) continue;
+        ++profile.particle_responses;
 
-        float e = 0.5f;
+        const float e = physics.restitution;
         glm::vec3 n = glm::normalize(p2.position - p1.position);
         glm::vec3 dv = (1.f + e) * (p2.velocity - p1.velocity);
         glm::vec3 nodge = (glm::dot(dv, n) / glm::dot(n, 2.f * n)) * n;
         p1.new_velocity += nodge;
         p2.new_velocity -= nodge;
     }
+    timer.lap(profile.particle_response_us, "particle response");
 
     // collision with vessel
     impl->scene.collisions_vessel.clear();
-    findCollisionsTriangles();
+    findCollisionsTriangles();  // only the bounding boxes of the particles
+    timer.lap(profile.vessel_broad_phase_us, "vessel broad phase");
 
     for (const size_t& particle_idx : impl->scene.collisions_vessel) {
         Particle& p = impl->scene.particles[particle_idx];
@@ -181,7 +526,8 @@ void Simulation::update(const float dt) {
         for (const size_t& triangle_idx : p.close_triangles) {
             // narrow phase
             Triangle& t = impl->scene.triangles[triangle_idx];
-            if (!p.intersect(t)) continue;  // triangle
+            if (!Physics::intersect(p, t, physics)) continue;  // triangle
+            ++profile.vessel_contacts;
 
             // is the particle moving away from triangle?
             glm::vec3 v = p.position - t.a;
@@ -190,7 +536,7 @@ void Simulation::update(const float dt) {
             // particle moves towards vessel?
             if (dot <= 0.0) continue;
 
-            float e = 0.5f;
+            const float e = physics.restitution;
             glm::vec3 n = t.normal;
             glm::vec3 dv = -(1.f + e) * (p.velocity);
             glm::vec3 nodge = (glm::dot(dv, n)) * n;
@@ -200,39 +546,95 @@ void Simulation::update(const float dt) {
         }
         p.close_triangles.clear();
     }
+    timer.lap(profile.vessel_narrow_phase_us, "vessel narrow phase");
 
     // apply changes to particles
-    for (auto& p : impl->scene.particles) {
-        p.velocity += p.new_velocity;
-        p.new_velocity = glm::vec3(0.0);
-        p.velocity /= 1.01;  // apply drag
-    }
+    workers.parallelFor(particles.size(), [&](size_t begin, size_t end, unsigned int) {
+        for (size_t i = begin; i < end; ++i) {
+            Particle& p = particles[i];
+            p.velocity += p.new_velocity;
+            p.new_velocity = glm::vec3(0.0);
+            p.velocity /= physics.drag;
+        }
+    });
+    timer.lap(profile.apply_us, "apply");
+    ++profile.steps;
 }
 
 // ------------------------------------------------------------------------------------------------
 
+SceneData& Simulation::scene() { return impl->scene; }
+
+// ------------------------------------------------------------------------------------------------
+
 void Simulation::findCollisionsParticles() {
-    for (size_t particle_idx = 0; particle_idx < impl->scene.particles.size();
-         ++particle_idx) {
-        const Particle& p = impl->scene.particles[particle_idx];
-
-        // find which neighbouring cells have to be checked
-        glm::vec3 deviation =
-            p.position - impl->scene.particle_grid.cellCenter(p.particle_grid_position);
-        int neighbour_index = 0;
-        if (deviation.x > 0.0f) neighbour_index |= 1;
-        if (deviation.y > 0.0f) neighbour_index |= 2;
-        if (deviation.z > 0.0f) neighbour_index |= 4;
-
-        impl->scene.close_particles.clear();
-        impl->scene.particle_grid.closeUniqueElements(p.particle_grid_position,
-                                                      particle_idx,
-                                                      neighbour_index,
-                                                      impl->scene.close_particles);
-
-        for (const auto& particle2_idx : impl->scene.close_particles) {
-            if (p.intersect(impl->scene.particles[particle2_idx])) {
-                impl->scene.collisions_particle.push_back({particle_idx, particle2_idx});
+    Physics::dispatch(impl->physics, [&](const auto& physics) {
+        findCollisionsParticles(physics);
+    });
+}
+
+// ------------------------------------------------------------------------------------------------
+
+template <typename Policy>
+void Simulation::findCollisionsParticles(const Policy& physics) {
+    SceneData& scene = impl->scene;
+    HierarchicalGrid& particle_grid = scene.particle_grid;
+
+    if (settings.particle_broad_phase == ParticleBroadPhase::CellPairs) {
+        // pairs within every level: half shell of each cell, chunks of cells in parallel
+        WorkerPool& workers = impl->physics_workers;
+        const unsigned int threads = workers.size();
+        scene.collisions_particle_threads.resize(threads);
+        std::vector<size_t> candidates(threads, 0);
+        for (size_t level = 0; level < particle_grid.levelCount(); ++level) {
+            const Grid& grid = particle_grid.grid(level);
+            auto cell_pairs = [&](size_t begin, size_t end, unsigned int t) {
+                TRACE_SCOPE("cell pairs");
+                std::vector<particle_pair>& collisions = scene.collisions_particle_threads[t];
+                size_t count = 0;
+                grid.forEachCellPair(begin, end, [&](const size_t a, const size_t b) {
+                    ++count;
+                    if (Physics::intersect(scene.particles[a], scene.particles[b], physics)) {
+                        collisions.push_back({a, b});
+                    }
+                });
+                candidates[t] = count;
+            };
+            workers.parallelFor(grid.occupiedCount(), cell_pairs);
+
+            // in the order of the chunks: the same pairs for any number of threads
+            for (unsigned int t = 0; t < threads; ++t) {
+                std::vector<particle_pair>& collisions = scene.collisions_particle_threads[t];
+                scene.collisions_particle.insert(
+                    scene.collisions_particle.end(), collisions.begin(), collisions.end());
+                collisions.clear();
+                step_profile.particle_candidates += candidates[t];
+                candidates[t] = 0;
+            }
+        }
+        if (particle_grid.levelCount() == 1) return;
+    }
+
+    for (size_t particle_idx = 0; particle_idx < scene.particles.size(); ++particle_idx) {
+        const Particle& p = scene.particles[particle_idx];
+
+        scene.close_particles.clear();
+        if (settings.particle_broad_phase == ParticleBroadPhase::CellPairs) {
+            // pairs with the larger particles of coarser levels
+            particle_grid.coarserElements(
+                p.position, p.particle_grid_level, scene.close_particles);
+        } else {
+            particle_grid.closeElements(p.position,
+                                        p.particle_grid_level,
+                                        p.particle_grid_position,
+                                        particle_idx,
+                                        scene.close_particles);
+        }
+
+        step_profile.particle_candidates += scene.close_particles.size();
+        for (const auto& particle2_idx : scene.close_particles) {
+            if (Physics::intersect(p, scene.particles[particle2_idx], physics)) {
+                scene.collisions_particle.push_back({particle_idx, particle2_idx});
             }
         }
     }
@@ -242,17 +644,21 @@ void Simulation::findCollisionsParticles() {
 
 void Simulation::findCollisionsTriangles() {
     bool collision_found;
+    impl->scene.scratch.reset();
+    Memory::ScratchVector<vec3i> affected_cells{
+        Memory::ArenaAllocator<vec3i>(impl->scene.scratch)};
     for (size_t particle_idx = 0; particle_idx < impl->scene.particles.size();
          particle_idx++) {
         collision_found = false;
         Particle& p = impl->scene.particles[particle_idx];
-        std::vector<vec3i> affected_cells;
+        affected_cells.clear();
         impl->scene.gridCoordsArea(p.bb, affected_cells);
         for (const vec3i& cell : affected_cells) {
-            for (const size_t triangle_idx : impl->scene.cells.at(cell.x, cell.y, cell.z)) {
+            for (const size_t triangle_idx : impl->scene.cells.unchecked(cell)) {
                 const Triangle& t = impl->scene.triangles[triangle_idx];
                 if (!p.intersect(t.bb)) continue;  // AABB
                 p.close_triangles.push_back(triangle_idx);
+                ++step_profile.vessel_candidates;
                 collision_found = true;
             }
         }
@@ -262,109 +668,225 @@ void Simulation::findCollisionsTriangles() {
 
 // ------------------------------------------------------------------------------------------------
 
+bool Simulation::prepareImaging(
+    [[maybe_unused]] const std::vector<ImageView>& views) {
+#ifdef GATHERING_HEADLESS
+    return false;
+#else
+    if (settings.headless || settings.imaging == ImagingBackend::Software) return false;
+    if (settings.channels & ImageChannel::PARTICLE_ID) return false;  // only on the CPU
+    if (impl->scene.polydisperse()) return false;  // the gl instances have a single radius
+    if (!impl->gl().isInitialized()) return false;
+    if (!impl->gl().isPrepared()) impl->gl().prepareInstance(impl->scene);
+    if (settings.imaging == ImagingBackend::OpenGL) {
+        impl->gl().updateInstances(impl->scene, views);  // only the visible particles per view
+    } else {
+        impl->gl().updateInstances(impl->scene);
+    }
+    return true;
+#endif
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::renderImages(const std::vector<ImageView>& views,
+                              const Resolution& resolution,
+                              [[maybe_unused]] const bool use_gl,
+                              const ImageOutputs& outputs) {
+#ifndef GATHERING_HEADLESS
+    if (use_gl) {
+        // the layered framebuffer only has the occupancy channel
+        const bool layered = settings.imaging == ImagingBackend::OpenGLLayered &&
+                             outputs.depth.empty() && outputs.density.empty();
+        if (layered) {
+            impl->gl().drawLayers(views, resolution.width, resolution.height);
+            impl->gl().readLayers(outputs.occupancy);
+        } else {
+            impl->gl().renderViews(
+                views, resolution.width, resolution.height, settings.samples, outputs);
+        }
+        return;
+    }
+#endif
+    impl->software_renderer.render(impl->scene, views, resolution, outputs);
+}
+
+// --------------------------------------------------------------------------------------------
+
 ImageContainer& Simulation::take_images(const int& slice_count) {
-    // calc camera positions for images
-    glm::vec3 vessel_radius = (impl->scene.vessel_bb.max - impl->scene.vessel_bb.min) / 2.0f;
-    glm::vec3 vessel_center = impl->scene.vessel_bb.min + vessel_radius;
-    images.clear();
-
-    std::vector<glm::vec3> camera_positions;
-    camera_positions.push_back(vessel_center + glm::vec3(vessel_radius.x, 0, 0));
-    camera_positions.push_back(vessel_center + glm::vec3(0.1f, vessel_radius.y, 0.1f));
-    camera_positions.push_back(vessel_center + glm::vec3(0, 0, vessel_radius.z));
-
-    std::vector<glm::mat4> projections;
-    projections.push_back(glm::ortho(-vessel_radius.z - 1.0f,
-                                     vessel_radius.z + 1.0f,
-                                     -vessel_radius.y - 1.0f,
-                                     vessel_radius.y + 1.0f,
-                                     -1.f,
-                                     2.f * vessel_radius.z + 1.f));
-    projections.push_back(glm::ortho(-vessel_radius.x - 1.0f,
-                                     vessel_radius.x + 1.0f,
-                                     -vessel_radius.z - 1.0f,
-                                     vessel_radius.z + 1.0f,
-                                     -1.f,
-                                     2.f * vessel_radius.z + 1.f));
-    projections.push_back(glm::ortho(-vessel_radius.x - 1.0f,
-                                     vessel_radius.x + 1.0f,
-                                     -vessel_radius.y - 1.0f,
-                                     vessel_radius.y + 1.0f,
-                                     -1.f,
-                                     2.f * vessel_radius.z + 1.f));
-
-    std::vector<glm::vec3> up_vector;
-    up_vector.push_back(glm::vec3(0, 1, 0));
-    up_vector.push_back(glm::vec3(0, 0, 1));
-    up_vector.push_back(glm::vec3(0, 1, 0));
-
-    // get/set resolution
-    impl->gl.setWindowVisibility(true);
-    GLint viewport[4];
-    glGetIntegerv(GL_VIEWPORT, viewport);  // viewport: x, y, width, height
-    int width = settings.resolution.width;
-    int height = settings.resolution.height;
-    impl->gl.setWindowSize(width, height);
-    impl->gl.setImageMode(true);
-
-    // prepare scene and buffer
-    if (!impl->gl.isPrepared()) impl->gl.prepareInstance(impl->scene);
-
-    // profile
-    for (int i = 0; i < 3; ++i) {
-        impl->gl.setProjection(projections[i]);
-        impl->gl.setView(glm::lookAt(camera_positions[i],
-                                     vessel_center,
-                                     up_vector[i]));  // (position, look at, up))
-        impl->gl.updateScene(impl->scene);
-        impl->gl.renderFrame();
-
-        // to image
-        glPixelStorei(GL_PACK_ALIGNMENT, 1);
-        glReadBuffer(GL_FRONT);
-        glReadPixels(
-            0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, images.data(width * height));
+    return take_images(slice_count, {settings.resolution}).front();
+}
+
+// --------------------------------------------------------------------------------------------
+
+std::vector<ImageContainer>& Simulation::take_images(
+    const int& slice_count, const std::vector<Resolution>& resolutions) {
+    waitSteps();
+    PhaseTimer timer;
+    std::vector<ImageView> views = imageViews(impl->scene.vessel_bb, slice_count);
+    const bool use_gl = prepareImaging(views);  // uploads the particles once for all sizes
+    image_sets.resize(resolutions.size());
+
+    for (size_t r = 0; r < resolutions.size(); ++r) {
+        const Resolution& resolution = resolutions[r];
+        ImageContainer& container = image_sets[r];
+        container.reset(resolution.width, resolution.height, views.size(), settings.channels);
+        uintptr_t base = reinterpret_cast<uintptr_t>(container.data());
+        renderImages(views, resolution, use_gl, imageOutputs(container, base));
+    }
+    timer.lap(step_profile.images_us, "take_images");
+
+    return image_sets;
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::take_images(const int& slice_count, unsigned char* output) {
+    waitSteps();
+    PhaseTimer timer;
+    std::vector<ImageView> views = imageViews(impl->scene.vessel_bb, slice_count);
+    const bool use_gl = prepareImaging(views);
+    const Resolution& resolution = settings.resolution;
+    ImageContainer layout;  // occupancy only, no storage
+    layout.width = resolution.width;
+    layout.height = resolution.height;
+    layout.content_count = views.size();
+    renderImages(views, resolution, use_gl, imageOutputs(layout, uintptr_t(output)));
+    timer.lap(step_profile.images_us, "take_images");
+}
+
+// --------------------------------------------------------------------------------------------
+
+std::future<ImageContainer> Simulation::take_images_async(const int& slice_count) {
+    struct Delivery {
+        ImageContainer images;
+        bool done = false;
+    };
+    auto delivery = std::make_shared<Delivery>();
+    take_images_async(slice_count, [delivery](const ImageContainer& images) {
+        delivery->images = images;
+        delivery->done = true;
+    });
+
+    // deferred: waiting for the future delivers the readbacks on the waiting thread
+    return std::async(std::launch::deferred, [this, delivery]() {
+        if (!delivery->done) wait_images();
+        if (!delivery->done) throw std::runtime_error("The image readback failed");
+        return std::move(delivery->images);
+    });
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::take_images_async(const int& slice_count, ImageCallback callback) {
+    waitSteps();
+    PhaseTimer timer;
+    std::vector<ImageView> views = imageViews(impl->scene.vessel_bb, slice_count);
+    const Resolution resolution = settings.resolution;
+    const size_t image_count = views.size();
+    const unsigned int channels = settings.channels;
+    const bool use_gl = prepareImaging(views);
+
+#ifndef GATHERING_HEADLESS
+    if (use_gl) {
+        // with an active readback the output pointers are offsets into the pixel buffer, which
+        // has the layout of the final container
+        ImageContainer layout;
+        layout.width = resolution.width;
+        layout.height = resolution.height;
+        layout.content_count = image_count;
+        layout.channels = channels | ImageChannel::OCCUPANCY;
+        impl->gl().beginReadback(layout.blockSize());
+        try {
+            renderImages(views, resolution, use_gl, imageOutputs(layout, 0));
+        } catch (...) {
+            impl->gl().cancelReadback();
+            throw;
+        }
+
+        const size_t width = layout.width, height = layout.height;
+        auto deliver = [callback, width, height, image_count, channels](
+                           const unsigned char* pixels) {
+            ImageContainer result;
+            result.reset(width, height, image_count, channels);
+            std::memcpy(result.data(), pixels, result.blockSize());
+            callback(result);
+        };
+        impl->gl().endReadback(deliver);
+        timer.lap(step_profile.images_us, "take_images");
+        return;
     }
+#endif
 
-    // slice
-    float thickness = (vessel_radius.z * 2.f + 0.1f) / slice_count;
-    impl->gl.setView(glm::lookAt(camera_positions[2],
-                                 vessel_center,
-                                 up_vector[2]));  // (position, look at, up))
-    for (float i = 0; i < slice_count; ++i) {
-        impl->gl.setProjection(glm::ortho(-vessel_radius.x - 1.0f,
-                                          vessel_radius.x + 1.0f,
-                                          -vessel_radius.z - 1.0f,
-                                          vessel_radius.z + 1.0f,
-                                          -0.1f + i * thickness,
-                                          -0.1f + (i + 1) * thickness));
-        impl->gl.updateScene(impl->scene);
-        impl->gl.renderFrame();
-        // to image
-        glPixelStorei(GL_PACK_ALIGNMENT, 1);
-        glReadBuffer(GL_FRONT);
-        glReadPixels(
-            0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, images.data(width * height));
+    ImageContainer result;
+    result.reset(resolution.width, resolution.height, image_count, channels);
+    uintptr_t base = reinterpret_cast<uintptr_t>(result.data());
+    renderImages(views, resolution, use_gl, imageOutputs(result, base));
+    timer.lap(step_profile.images_us, "take_images");
+    callback(result);
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::wait_images() {
+#ifndef GATHERING_HEADLESS
+    if (impl && impl->hasGL()) {
+        PhaseTimer timer;
+        impl->gl().pollReadbacks(true);
+        timer.lap(step_profile.readback_us, "readback");
     }
+#endif
+}
 
-    // undo changes to gl
-    impl->gl.setImageMode(false);
-    impl->gl.setWindowSize(viewport[2], viewport[3]);
-    return images;
+// --------------------------------------------------------------------------------------------
+
+void Simulation::releaseGL() {
+    waitSteps();
+    std::exception_ptr error;
+    try {
+        wait_images();  // the readbacks need the context
+    } catch (...) {
+        error = std::current_exception();
+    }
+#ifndef GATHERING_HEADLESS
+    impl->releaseGL();
+#endif
+    if (error) std::rethrow_exception(error);
 }
 
 // --------------------------------------------------------------------------------------------
 
 void Simulation::run(ForceSchedule& schedule, const bool headless) {
-    impl->gl.setWindowVisibility(!headless);
+    waitSteps();
     computeFrame(schedule, headless, 0);
 }
 
 // --------------------------------------------------------------------------------------------
 
 void Simulation::runSteps(int n, ForceSchedule& schedule, const bool headless) {
-    impl->gl.setWindowVisibility(!headless);
+    waitSteps();
+    impl->run_begin = Trace::Clock::now();
     computeFrame(schedule, headless, n);
+    dumpTrace();
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::runStepsAsync(const int n, const ForceSchedule& schedule) {
+    waitSteps();
+    if (n <= 0) return;
+    impl->async_schedule = schedule;
+    impl->run_begin = Trace::Clock::now();
+    impl->stepping = std::async(std::launch::async, [this, n]() {
+        computeFrame(impl->async_schedule, true, static_cast<size_t>(n));
+        dumpTrace();
+    });
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::waitSteps() {
+    if (impl && impl->stepping.valid()) impl->stepping.get();
 }
 
 // --------------------------------------------------------------------------------------------
@@ -372,28 +894,87 @@ void Simulation::runSteps(int n, ForceSchedule& schedule, const bool headless) {
 void Simulation::runTime(const int milliseconds,
                          ForceSchedule& schedule,
                          const bool headless) {
-    impl->gl.setWindowVisibility(!headless);
     // TODO unit of dt?!
     size_t n = static_cast<size_t>(milliseconds / dt);
+    waitSteps();
+    impl->run_begin = Trace::Clock::now();
     computeFrame(schedule, headless, n);
+    dumpTrace();
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::dumpTrace() {
+    if (!settings.trace_file.empty()) Trace::dump(settings.trace_file, impl->run_begin);
+}
+
+// --------------------------------------------------------------------------------------------
+
+ParticleArrays Simulation::particleArrays() {
+    waitSteps();
+    ParticleArrays arrays;
+    ParticleVector& particles = impl->scene.particles;
+    if (particles.empty()) return arrays;
+    arrays.position = &particles[0].position.x;
+    arrays.velocity = &particles[0].velocity.x;
+    arrays.mass = &particles[0].mass;
+    arrays.radius = &particles[0].radius;
+    arrays.count = particles.size();
+    arrays.stride = sizeof(Particle);
+    return arrays;
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::setRenderPacing(const unsigned int interval_steps,
+                                 const float budget_ms,
+                                 const bool interpolation) {
+    waitSteps();
+    settings.render_interval_steps = interval_steps;
+    settings.render_budget_ms = budget_ms;
+    settings.render_interpolation = interpolation;
+}
+
+// --------------------------------------------------------------------------------------------
+
+StepProfile Simulation::profile() {
+    waitSteps();
+    return step_profile;
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::resetProfile() {
+    waitSteps();
+    step_profile = StepProfile();
+}
+
+// --------------------------------------------------------------------------------------------
+
+void Simulation::setTimeStep(const float dt) {
+    waitSteps();
+    this->dt = dt;
 }
 
 // --------------------------------------------------------------------------------------------
 
 void Simulation::showCurrentState() {
-    impl->gl.setWindowVisibility(true);
-    if (!impl->gl.isPrepared()) impl->gl.prepareInstance(impl->scene);
+#ifndef GATHERING_HEADLESS
+    waitSteps();
+    if (!prepareDisplay(false)) return;
 
     while (true) {
-        impl->gl.updateScene(impl->scene);
-        impl->gl.renderFrame();
-        if (impl->gl.closed()) break;
+        impl->gl().updateScene(impl->scene);
+        impl->gl().renderFrame();
+        if (impl->gl().closed()) break;
     }
+#endif
 }
 
 // --------------------------------------------------------------------------------------------
 
 void Simulation::addParticles(const int n, const float mass_mean, const float mass_stddev) {
+    waitSteps();
     impl->scene.addParticles(n, mass_mean, mass_stddev);
 }
 
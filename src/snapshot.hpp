@@ -0,0 +1,107 @@
+#ifndef GATHERING_SNAPSHOT_H
+#define GATHERING_SNAPSHOT_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "gathering/glm_include.hpp"
+#include "scene.hpp"
+
+namespace gathering {
+
+/**
+ * @brief The part of a particle that is needed to draw it.
+ */
+struct ParticleState {
+    glm::vec3 position;
+    float mass;
+    glm::vec3 velocity;
+};
+
+/**
+ * @brief Copy of the dynamic part of a scene at a given simulation step.
+ */
+struct SceneSnapshot {
+    std::vector<ParticleState> particles;
+    size_t step = 0;
+    std::chrono::steady_clock::time_point time;  // when it was captured
+
+    void capture(const SceneData& scene, const size_t step) {
+        this->step = step;
+        time = std::chrono::steady_clock::now();
+        particles.resize(scene.particles.size());
+        for (size_t i = 0; i < scene.particles.size(); ++i) {
+            const Particle& p = scene.particles[i];
+            particles[i] = {p.position, p.mass, p.velocity};
+        }
+    }
+
+    /**
+     * @brief Blends the positions linearly from one snapshot to the next one, so that 'to' is
+     * reached one capture interval (to.time - from.time) after 'to' was captured.
+     */
+    void interpolate(const SceneSnapshot& from,
+                     const SceneSnapshot& to,
+                     const std::chrono::steady_clock::time_point now) {
+        using seconds = std::chrono::duration<float>;
+        const float interval = seconds(to.time - from.time).count();
+        float alpha = interval > 0.f ? seconds(now - to.time).count() / interval : 1.f;
+        alpha = std::min(std::max(alpha, 0.f), 1.f);
+
+        step = to.step;
+        time = now;
+        particles = to.particles;
+        const size_t count = std::min(from.particles.size(), to.particles.size());
+        for (size_t i = 0; i < count; ++i) {
+            particles[i].position =
+                glm::mix(from.particles[i].position, to.particles[i].position, alpha);
+        }
+    }
+};
+
+// ------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Hands the latest state from one writer thread to one reader thread. Writer and reader
+ * each own a buffer; a third buffer holds the latest published state, so neither side ever
+ * waits for the other one to finish its work (only for the swap of two indices).
+ */
+template <typename T>
+class SnapshotBuffer {
+   public:
+    /**
+     * @brief Buffer of the writer. Write the next state into it and publish it.
+     */
+    T& back() { return slots[back_idx]; }
+
+    void publish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(back_idx, ready_idx);
+        fresh = true;
+    }
+
+    /**
+     * @brief Latest published state. Valid until the next call.
+     */
+    const T& latest() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fresh) {
+            std::swap(front_idx, ready_idx);
+            fresh = false;
+        }
+        return slots[front_idx];
+    }
+
+   private:
+    std::array<T, 3> slots;
+    size_t back_idx = 0, ready_idx = 1, front_idx = 2;
+    bool fresh = false;  // ready_idx holds a state that has not been read yet
+    std::mutex mutex;
+};
+
+}  // namespace gathering
+
+#endif
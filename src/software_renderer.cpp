@@ -0,0 +1,317 @@
+#include "software_renderer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "meta.hpp"
+#include "trace.hpp"
+
+namespace gathering {
+
+namespace {
+
+/**
+ * @brief Fills all pixels whose center lies within the ellipse, restricted to the given rows.
+ */
+inline void fillEllipse(unsigned char* image,
+                        const Resolution& resolution,
+                        const float center_x,
+                        const float center_y,
+                        const float radius_x,
+                        const float radius_y,
+                        const int row_begin,
+                        const int row_end) {
+    int row_min = std::max(row_begin, static_cast<int>(std::ceil(center_y - radius_y - 0.5f)));
+    int row_max =
+        std::min(row_end - 1, static_cast<int>(std::floor(center_y + radius_y - 0.5f)));
+    for (int row = row_min; row <= row_max; ++row) {
+        float dy = (row + 0.5f - center_y) / radius_y;
+        float span = radius_x * std::sqrt(std::max(0.f, 1.f - dy * dy));
+        int col_min = std::max(0, static_cast<int>(std::ceil(center_x - span - 0.5f)));
+        int col_max = std::min(resolution.width - 1,
+                               static_cast<int>(std::floor(center_x + span - 0.5f)));
+        if (col_max < col_min) continue;
+        std::memset(image + static_cast<size_t>(row) * resolution.width + col_min,
+                    255,
+                    col_max - col_min + 1);
+    }
+}
+
+/**
+ * @brief A particle projected into a view: its ellipse in pixels (cut by the depth range of
+ * the view) and the ellipse of the whole sphere, which gives the depth of its surface.
+ */
+struct Splat {
+    float x, y;                // center in pixels
+    float radius_x, radius_y;  // of the cross-section within the view
+    float sphere_x, sphere_y;  // of the whole sphere
+    float sphere_radius;       // world units
+    float depth;               // of the center (eye space)
+    uint32_t id;               // index + 1
+};
+
+/**
+ * @brief Like fillEllipse, but also writes the other channels of a view. Depth and id are
+ * only written where the surface of the sphere is closer than the current depth.
+ */
+inline void shadeEllipse(const ImageOutputs& outputs,
+                         const size_t view,
+                         const Resolution& resolution,
+                         const Splat& splat,
+                         const float near_plane,
+                         const float far_plane,
+                         const int row_begin,
+                         const int row_end) {
+    unsigned char* occupancy = outputs.occupancy[view];
+    float* depth = outputs.depth.empty() ? nullptr : outputs.depth[view];
+    float* density = outputs.density.empty() ? nullptr : outputs.density[view];
+    uint32_t* ids = outputs.ids.empty() ? nullptr : outputs.ids[view];
+    const float depth_scale = 1.f / (far_plane - near_plane);
+
+    int row_min =
+        std::max(row_begin, static_cast<int>(std::ceil(splat.y - splat.radius_y - 0.5f)));
+    int row_max =
+        std::min(row_end - 1, static_cast<int>(std::floor(splat.y + splat.radius_y - 0.5f)));
+    for (int row = row_min; row <= row_max; ++row) {
+        float dy = (row + 0.5f - splat.y) / splat.radius_y;
+        float span = splat.radius_x * std::sqrt(std::max(0.f, 1.f - dy * dy));
+        int col_min = std::max(0, static_cast<int>(std::ceil(splat.x - span - 0.5f)));
+        int col_max = std::min(resolution.width - 1,
+                               static_cast<int>(std::floor(splat.x + span - 0.5f)));
+        float qy = (row + 0.5f - splat.y) / splat.sphere_y;
+        size_t offset = static_cast<size_t>(row) * resolution.width;
+        for (int col = col_min; col <= col_max; ++col) {
+            size_t idx = offset + col;
+            occupancy[idx] = 255;
+            if (density != nullptr) density[idx] += 1.f;
+            if (depth == nullptr) continue;
+
+            float qx = (col + 0.5f - splat.x) / splat.sphere_x;
+            float height = std::sqrt(std::max(0.f, 1.f - qx * qx - qy * qy));
+            float z = (splat.depth - splat.sphere_radius * height - near_plane) * depth_scale;
+            z = std::min(std::max(z, 0.f), 1.f);
+            if (z < depth[idx]) {
+                depth[idx] = z;
+                if (ids != nullptr) ids[idx] = splat.id;
+            }
+        }
+    }
+}
+
+// affine part of an orthographic projection for one axis, mapped to pixel coordinates
+inline glm::vec4 pixelMapping(const glm::mat4& view,
+                              const glm::mat4& projection,
+                              const int axis,
+                              const float pixels) {
+    float half = pixels * 0.5f;
+    glm::vec4 row(view[0][axis], view[1][axis], view[2][axis], view[3][axis]);
+    glm::vec4 mapping = row * (projection[axis][axis] * half);
+    mapping.w += (projection[3][axis] + 1.f) * half;
+    return mapping;
+}
+
+}  // namespace
+
+// ------------------------------------------------------------------------------------------------
+
+void SoftwareRenderer::render(const SceneData& scene,
+                              const std::vector<ImageView>& views,
+                              const Resolution& resolution,
+                              const ImageOutputs& outputs) {
+    const bool polydisperse = scene.polydisperse();
+    buildGroups(
+        views, resolution, polydisperse ? scene.max_particle_radius : scene.particle_radius);
+    const size_t particle_count = scene.particles.size();
+    const unsigned int threads = threadCount(thread_count);
+    const size_t image_size = static_cast<size_t>(resolution.width) * resolution.height;
+
+    // the closest particle per pixel needs a depth buffer, even if no depth is requested
+    ImageOutputs channels = outputs;
+    if (!channels.ids.empty() && channels.depth.empty()) {
+        scratch_depth.resize(image_size * channels.ids.size());
+        for (size_t i = 0; i < channels.ids.size(); ++i) {
+            channels.depth.push_back(scratch_depth.data() + i * image_size);
+        }
+    }
+
+    // 1. project all particles once per group
+    for (auto& group : groups) {
+        group.x.resize(particle_count);
+        group.y.resize(particle_count);
+        group.depth.resize(particle_count);
+    }
+    radii.resize(polydisperse ? particle_count : 0);
+    parallelFor(particle_count, threads, [&](size_t begin, size_t end, unsigned int) {
+        TRACE_SCOPE("project particles");
+        for (auto& group : groups) project(scene, group, begin, end);
+        if (!polydisperse) return;
+        for (size_t i = begin; i < end; ++i) radii[i] = scene.particles[i].radius;
+    });
+
+    // 2. every thread clears and rasterises a band of rows in all images
+    parallelFor(resolution.height, threads, [&](size_t begin, size_t end, unsigned int) {
+        TRACE_SCOPE("rasterise band");
+        size_t band_offset = begin * resolution.width;
+        size_t band_size = (end - begin) * resolution.width;
+        for (auto* image : channels.occupancy) std::memset(image + band_offset, 0, band_size);
+        for (auto* image : channels.depth) {
+            std::fill(image + band_offset, image + band_offset + band_size, 1.f);
+        }
+        for (auto* image : channels.density) {
+            std::fill(image + band_offset, image + band_offset + band_size, 0.f);
+        }
+        for (auto* image : channels.ids) {
+            std::fill(image + band_offset, image + band_offset + band_size, 0u);
+        }
+        for (const auto& group : groups) {
+            rasterise(group,
+                      polydisperse ? radii.data() : nullptr,
+                      resolution,
+                      channels,
+                      static_cast<int>(begin),
+                      static_cast<int>(end));
+        }
+    });
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void SoftwareRenderer::buildGroups(const std::vector<ImageView>& views,
+                                   const Resolution& resolution,
+                                   const float particle_radius) {
+    groups.resize(0);
+    for (size_t i = 0; i < views.size(); ++i) {
+        const ImageView& view = views[i];
+        glm::vec4 project_x = pixelMapping(view.view, view.projection, 0, resolution.width);
+        glm::vec4 project_y = pixelMapping(view.view, view.projection, 1, resolution.height);
+
+        bool same_camera = !groups.empty() && groups.back().project_x == project_x &&
+                           groups.back().project_y == project_y;
+        if (!same_camera) {
+            ViewGroup group;
+            group.first_view = i;
+            group.project_x = project_x;
+            group.project_y = project_y;
+            group.project_depth = -glm::vec4(
+                view.view[0][2], view.view[1][2], view.view[2][2], view.view[3][2]);
+            group.radius = particle_radius;
+            group.radius_x =
+                std::abs(view.projection[0][0]) * particle_radius * resolution.width * 0.5f;
+            group.radius_y =
+                std::abs(view.projection[1][1]) * particle_radius * resolution.height * 0.5f;
+            groups.push_back(std::move(group));
+        }
+
+        ViewGroup& group = groups.back();
+        if (group.view_count != 0) {
+            group.sorted = group.sorted && view.near_plane >= group.far_planes.back();
+        }
+        group.near_planes.push_back(view.near_plane);
+        group.far_planes.push_back(view.far_plane);
+        group.view_count++;
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void SoftwareRenderer::project(const SceneData& scene,
+                               ViewGroup& group,
+                               size_t begin,
+                               size_t end) const {
+    const glm::vec4 px = group.project_x;
+    const glm::vec4 py = group.project_y;
+    const glm::vec4 pd = group.project_depth;
+    float* x = group.x.data();
+    float* y = group.y.data();
+    float* depth = group.depth.data();
+
+    // branch free to allow vectorisation
+    for (size_t i = begin; i < end; ++i) {
+        const glm::vec3& p = scene.particles[i].position;
+        x[i] = px.x * p.x + px.y * p.y + px.z * p.z + px.w;
+        y[i] = py.x * p.x + py.y * p.y + py.z * p.z + py.w;
+        depth[i] = pd.x * p.x + pd.y * p.y + pd.z * p.z + pd.w;
+    }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void SoftwareRenderer::rasterise(const ViewGroup& group,
+                                 const float* radii,
+                                 const Resolution& resolution,
+                                 const ImageOutputs& outputs,
+                                 int row_begin,
+                                 int row_end) const {
+    const float* x = group.x.data();
+    const float* y = group.y.data();
+    const float* depth = group.depth.data();
+    const size_t count = group.x.size();
+    const float band_min = row_begin - group.radius_y;
+    const float band_max = row_end + group.radius_y;
+    const bool occupancy_only =
+        outputs.depth.empty() && outputs.density.empty() && outputs.ids.empty();
+
+    for (size_t i = 0; i < count; ++i) {
+        if (y[i] < band_min || y[i] > band_max) continue;  // not within this band
+        const float d = depth[i];
+        float radius = group.radius, radius_x = group.radius_x, radius_y = group.radius_y;
+        if (radii != nullptr) {
+            radius = radii[i];
+            radius_x *= radius / group.radius;
+            radius_y *= radius / group.radius;
+        }
+
+        // views intersecting [d - r, d + r]
+        size_t first = 0;
+        if (group.sorted) {
+            first = std::upper_bound(
+                        group.far_planes.begin(), group.far_planes.end(), d - radius) -
+                    group.far_planes.begin();
+        }
+
+        for (size_t v = first; v < group.view_count; ++v) {
+            float near_plane = group.near_planes[v];
+            float far_plane = group.far_planes[v];
+            if (near_plane >= d + radius) {
+                if (group.sorted) break;
+                continue;
+            }
+            if (far_plane <= d - radius) continue;
+
+            // radius of the part of the sphere that lies between near and far plane
+            float scale = 1.f;
+            float distance = std::max(near_plane - d, d - far_plane);
+            if (distance > 0.f) {
+                scale = std::sqrt(1.f - (distance * distance) / (radius * radius));
+            }
+
+            const size_t view = group.first_view + v;
+            if (occupancy_only) {
+                fillEllipse(outputs.occupancy[view],
+                            resolution,
+                            x[i],
+                            y[i],
+                            radius_x * scale,
+                            radius_y * scale,
+                            row_begin,
+                            row_end);
+                continue;
+            }
+
+            Splat splat = {x[i],
+                           y[i],
+                           radius_x * scale,
+                           radius_y * scale,
+                           radius_x,
+                           radius_y,
+                           radius,
+                           d,
+                           static_cast<uint32_t>(i + 1)};
+            shadeEllipse(
+                outputs, view, resolution, splat, near_plane, far_plane, row_begin, row_end);
+        }
+    }
+}
+
+}  // namespace gathering
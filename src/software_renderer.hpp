@@ -0,0 +1,76 @@
+#ifndef GATHERING_SOFTWARE_RENDERER_H
+#define GATHERING_SOFTWARE_RENDERER_H
+
+#include <vector>
+
+#include "gathering/simulation.hpp"
+#include "imaging.hpp"
+#include "scene.hpp"
+
+namespace gathering {
+
+/**
+ * @brief Renders images of the particles on the CPU: occupancy and optionally depth, density
+ * and the id of the closest particle (see ImageChannel). Used whenever no
+ * opengl context is available (headless builds or SimulationSettings::headless) or if
+ * ImagingBackend::Software is selected.
+ * Particles are spheres that are cut by the near and far plane of the view, i.e. a slice
+ * contains the cross-section of every particle intersecting it. The images have the same
+ * layout as the ones read back from opengl: rows from bottom to top.
+ *
+ * All views are rendered in one pass: views sharing the same camera (e.g. all slices) are
+ * grouped, particles are projected once per group and every thread rasterises a band of rows
+ * of all images.
+ */
+class SoftwareRenderer {
+   public:
+    SoftwareRenderer(const unsigned int thread_count = 0) : thread_count(thread_count) {}
+    void setThreadCount(const unsigned int thread_count) { this->thread_count = thread_count; }
+    /**
+     * @param outputs One buffer (width * height pixels) per view and captured channel.
+     */
+    void render(const SceneData& scene,
+                const std::vector<ImageView>& views,
+                const Resolution& resolution,
+                const ImageOutputs& outputs);
+
+   private:
+    /**
+     * @brief Views that only differ in their depth range. Stores the projected particles
+     * (pixel coordinates and eye space depth) as structure of arrays.
+     */
+    struct ViewGroup {
+        size_t first_view = 0;
+        size_t view_count = 0;
+        bool sorted = true;  // depth ranges are ascending and don't overlap
+        glm::vec4 project_x = glm::vec4(0.f);
+        glm::vec4 project_y = glm::vec4(0.f);
+        glm::vec4 project_depth = glm::vec4(0.f);
+        float radius = 0.f;    // particle radius (world units); the largest one if they differ
+        float radius_x = 0.f;  // of this radius in pixels
+        float radius_y = 0.f;
+        std::vector<float> near_planes;
+        std::vector<float> far_planes;
+        std::vector<float> x, y, depth;
+    };
+
+    void buildGroups(const std::vector<ImageView>& views,
+                     const Resolution& resolution,
+                     const float particle_radius);
+    void project(const SceneData& scene, ViewGroup& group, size_t begin, size_t end) const;
+    void rasterise(const ViewGroup& group,
+                   const float* radii,
+                   const Resolution& resolution,
+                   const ImageOutputs& outputs,
+                   int row_begin,
+                   int row_end) const;
+
+    unsigned int thread_count;
+    std::vector<ViewGroup> groups;
+    std::vector<float> scratch_depth;  // for particle ids without the depth channel
+    std::vector<float> radii;          // of all particles if they differ
+};
+
+}  // namespace gathering
+
+#endif
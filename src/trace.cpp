@@ -0,0 +1,193 @@
+#include "trace.hpp"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace gathering {
+namespace Trace {
+
+std::atomic<bool> recording(false);
+
+namespace {
+
+constexpr uint64_t RING_SIZE = 1 << 15;  // events per thread
+
+struct Event {
+    const char* name;
+    int64_t begin_ns;     // since the epoch
+    int64_t duration_ns;  // < 0: instant event
+};
+
+/**
+ * @brief Slot of a ring that is read while its thread may overwrite it (sequence lock): the
+ * sequence is odd while the slot is written and 2 * (i + 1) once it holds the i-th event of
+ * the ring. A reader only accepts an event if the sequence was the same before and after
+ * reading it.
+ */
+struct Slot {
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<const char*> name{nullptr};
+    std::atomic<int64_t> begin_ns{0};
+    std::atomic<int64_t> duration_ns{0};
+
+    void write(const uint64_t i, const Event& e) {
+        sequence.store(2 * i + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        name.store(e.name, std::memory_order_relaxed);
+        begin_ns.store(e.begin_ns, std::memory_order_relaxed);
+        duration_ns.store(e.duration_ns, std::memory_order_relaxed);
+        sequence.store(2 * i + 2, std::memory_order_release);
+    }
+
+    // false if the slot doesn't hold the i-th event (anymore)
+    bool read(const uint64_t i, Event& e) const {
+        if (sequence.load(std::memory_order_acquire) != 2 * i + 2) return false;
+        e.name = name.load(std::memory_order_relaxed);
+        e.begin_ns = begin_ns.load(std::memory_order_relaxed);
+        e.duration_ns = duration_ns.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return sequence.load(std::memory_order_relaxed) == 2 * i + 2;
+    }
+};
+
+/**
+ * @brief Events of one thread; only this thread writes. A ring is handed to the next new
+ * thread once its thread has finished, so short-lived workers (parallelFor) share rings and
+ * show up as one lane per concurrently running thread.
+ */
+struct Ring {
+    std::unique_ptr<Slot[]> slots = std::make_unique<Slot[]>(RING_SIZE);
+    std::atomic<uint64_t> written{0};  // number of events ever written
+    std::atomic<bool> in_use{true};
+};
+
+std::mutex rings_mutex;  // adding rings and dumping
+std::vector<std::unique_ptr<Ring>> rings;
+const Clock::time_point epoch = Clock::now();
+
+std::mutex users_mutex;
+int users = 0;  // unmatched start calls
+
+struct ThreadRing {
+    Ring* ring = nullptr;
+    ~ThreadRing() {
+        if (ring != nullptr) ring->in_use.store(false);
+    }
+};
+
+thread_local ThreadRing thread_ring;
+
+Ring& threadRing() {
+    if (thread_ring.ring == nullptr) {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        for (auto& ring : rings) {
+            bool expected = false;
+            if (ring->in_use.compare_exchange_strong(expected, true)) {
+                thread_ring.ring = ring.get();
+                break;
+            }
+        }
+        if (thread_ring.ring == nullptr) {
+            rings.push_back(std::make_unique<Ring>());
+            thread_ring.ring = rings.back().get();
+        }
+    }
+    return *thread_ring.ring;
+}
+
+int64_t sinceEpoch(const Clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t - epoch).count();
+}
+
+void record(const char* name, const int64_t begin_ns, const int64_t duration_ns) {
+    Ring& ring = threadRing();
+    const uint64_t i = ring.written.load(std::memory_order_relaxed);
+    ring.slots[i % RING_SIZE].write(i, {name, begin_ns, duration_ns});
+    ring.written.store(i + 1, std::memory_order_release);
+}
+
+}  // namespace
+
+// ------------------------------------------------------------------------------------------------
+
+void start() {
+    std::lock_guard<std::mutex> lock(users_mutex);
+    if (users++ == 0) recording.store(true);
+}
+
+void stop() {
+    std::lock_guard<std::mutex> lock(users_mutex);
+    if (users > 0 && --users == 0) recording.store(false);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void complete(const char* name, const Clock::time_point begin, const Clock::time_point end) {
+    record(name, sinceEpoch(begin), std::max<int64_t>(0, sinceEpoch(end) - sinceEpoch(begin)));
+}
+
+// ------------------------------------------------------------------------------------------------
+
+void instant(const char* name) {
+    if (!enabled()) return;
+    record(name, sinceEpoch(Clock::now()), -1);
+}
+
+// ------------------------------------------------------------------------------------------------
+
+bool dump(const std::string& file, const Clock::time_point since) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    std::ofstream out(file);
+    if (!out) {
+        std::cerr << "Can't write the trace to " << file << std::endl;
+        return false;
+    }
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    char line[256];
+    const int64_t since_ns = sinceEpoch(since);
+    for (size_t r = 0; r < rings.size(); ++r) {
+        const Ring& ring = *rings[r];
+        uint64_t end = ring.written.load(std::memory_order_acquire);
+        uint64_t begin = end > RING_SIZE ? end - RING_SIZE : 0;
+
+        const unsigned long thread = static_cast<unsigned long>(r + 1);
+        for (uint64_t i = begin; i < end; ++i) {
+            // the thread may overwrite the oldest events in the meantime
+            Event e;
+            if (!ring.slots[i % RING_SIZE].read(i, e) || e.begin_ns < since_ns) continue;
+            if (e.duration_ns < 0) {
+                snprintf(line,
+                         sizeof(line),
+                         "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,"
+                         "\"tid\":%lu}",
+                         e.name,
+                         e.begin_ns * 1e-3,
+                         thread);
+            } else {
+                snprintf(line,
+                         sizeof(line),
+                         "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,"
+                         "\"tid\":%lu}",
+                         e.name,
+                         e.begin_ns * 1e-3,
+                         e.duration_ns * 1e-3,
+                         thread);
+            }
+            out << (first ? "\n" : ",\n") << line;
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+}  // namespace Trace
+}  // namespace gathering
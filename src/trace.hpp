@@ -0,0 +1,96 @@
+#ifndef GATHERING_TRACE_H
+#define GATHERING_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace gathering {
+
+/**
+ * @brief Timeline of scoped events in the Chrome trace format (chrome://tracing, Perfetto).
+ * Every thread records into its own ring buffer without locks; once a ring is full, the
+ * oldest events are overwritten. Recording is off by default and then costs a single atomic
+ * load per scope. Names must be string literals (they are stored as pointers).
+ */
+namespace Trace {
+
+typedef std::chrono::steady_clock Clock;
+
+extern std::atomic<bool> recording;
+
+inline bool enabled() { return recording.load(std::memory_order_relaxed); }
+
+/**
+ * @brief Starts recording (of all threads). The calls nest: recording goes on until every
+ * start was matched by a stop. Events that are still in the rings are kept.
+ */
+void start();
+void stop();
+
+/**
+ * @brief Adds an event that lasted from begin to end on the calling thread.
+ */
+void complete(const char* name, const Clock::time_point begin, const Clock::time_point end);
+
+/**
+ * @brief Adds an event without duration (e.g. a change of the force) on the calling thread.
+ */
+void instant(const char* name);
+
+/**
+ * @brief Writes the recorded events of all threads that began at or after 'since' as json to
+ * the file; events that are recorded while writing may be missing. Returns false if the file
+ * can't be written.
+ */
+bool dump(const std::string& file, const Clock::time_point since = Clock::time_point());
+
+/**
+ * @brief Calls start if active and the matching stop on destruction, so the nesting stays
+ * balanced if the owner fails to construct after it.
+ */
+class Recording {
+   public:
+    explicit Recording(const bool active) : active(active) {
+        if (active) start();
+    }
+    ~Recording() {
+        if (active) stop();
+    }
+    Recording(const Recording&) = delete;
+    Recording& operator=(const Recording&) = delete;
+
+   private:
+    bool active;
+};
+
+/**
+ * @brief Records the lifetime of the object as event (see TRACE_SCOPE).
+ */
+class Scope {
+   public:
+    explicit Scope(const char* name) : name(enabled() ? name : nullptr) {
+        if (this->name != nullptr) begin = Clock::now();
+    }
+    ~Scope() {
+        if (name != nullptr) complete(name, begin, Clock::now());
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    const char* name;
+    Clock::time_point begin;
+};
+
+}  // namespace Trace
+
+#define GATHERING_TRACE_CONCAT_(a, b) a##b
+#define GATHERING_TRACE_CONCAT(a, b) GATHERING_TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) \
+    ::gathering::Trace::Scope GATHERING_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+}  // namespace gathering
+
+#endif